@@ -9,17 +9,27 @@
 *  Description: Basic thread-safe memory manager, allocate and deallocate    *
 *               memory dynamically.                                          *
 *                                                                            *
-*               Uses either first-fit, next-fit, best-fit or worst-fit       *
-*               algorithm to allocate memory. This is determined in the      *
-*               initialize function.                                         *
+*               Uses either first-fit, next-fit, best-fit, worst-fit or      *
+*               segregated-fit algorithm to allocate memory. This is         *
+*               determined in the initialize function.                       *
 *                                                                            *
 *               Adjacent free memory blocks will be coalesced.               *
+*                                                                            *
+*               Free blocks are also kept in size-class bins, so the         *
+*               segregated-fit algorithm can find a block without walking    *
+*               the whole list.                                              *
 *----------------------------------------------------------------------------*
 */
 
 
+#define _GNU_SOURCE
+
 #include "memory_manager.h"
 
+#ifdef MM_TRACE
+  #include "memory_trace.h"
+#endif
+
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -27,118 +37,337 @@
 #include <assert.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 
 // define the structure to hold each memory block
+#ifdef COMPACT_HEADERS
+
+// a node is just its size, the low bits say whether it and the node
+// before it are free. Free nodes also keep their size in their last
+// word (a boundary tag) so the node after can find them.
+//
+// Freeing a node changes the flags of the node after it, which may be
+// in use, so the header is atomic for its owner to read without the lock.
+struct node_t
+{
+  _Atomic size_t header;
+  uint8_t        memory[];
+};
+
+#define NODE_FREE      ((size_t)1)
+#define NODE_PREV_FREE ((size_t)2)
+#define NODE_MAPPED    ((size_t)4)
+#define NODE_FLAGS     (NODE_FREE | NODE_PREV_FREE | NODE_MAPPED)
+
+#else
+
 struct node_t
 {
   struct node_t* next;
   struct node_t* prev;
   unsigned       free;
+  unsigned       mapped;
   size_t         size;
   uint8_t        memory[];
 };
 
-// linked list to store memory nodes
-static struct node_t* linked_list;
+#endif
+
+// free nodes store their bin links in the memory they are not using
+struct free_links_t
+{
+  struct node_t* next_free;
+  struct node_t* prev_free;
+};
+
+#define FREE_LINKS(p) ((struct free_links_t*)(p)->memory)
+
+// free nodes big enough to hold these after their bin links are also
+// kept in a tree ordered by size then address, for best and worst fit
+struct tree_links_t
+{
+  struct node_t* left;
+  struct node_t* right;
+  struct node_t* parent;
+};
+
+#define TREE_LINKS(p) ((struct tree_links_t*)((p)->memory + sizeof(struct free_links_t)))
+#define TREE_MIN_SIZE 128
+
+// smallest block of the buddy system, header included
+#define BUDDY_MIN_BLOCK 64
+
+// a buddy arena is lined up so a block's memory is aligned to its size,
+// up to this, so aligned allocations only need a big enough block
+#define BUDDY_ALIGNMENT 4096
+
+// size-class bins of free nodes, each bin is a doubly linked list
+// and bin_map has a bit set for every bin that is not empty
+#define BIN_COUNT 256
+#define BIN_MAP_BITS 64
+#define BIN_MAP_WORDS (BIN_COUNT / BIN_MAP_BITS)
+
+// a thread's place in the queue for an MCS lock, it waits on its
+// own node so waiting threads don't all spin on the lock's memory
+struct mcs_node_t
+{
+  _Atomic(struct mcs_node_t*) next;
+  atomic_int      waiting;
+
+  // only ever looked at by its own thread
+  int             in_use;
+};
+
+// a region of a heap with its own nodes and lock
+struct arena_t
+{
+  // linked list to store memory nodes
+  struct node_t*  linked_list;
+
+  //pointer to lastused/next node
+  struct node_t*  next_node;
+
+  //So it doesn't screw up when using threads.
+  pthread_mutex_t lock;
+  unsigned        lock_policy;
+
+  // a ticket lock's next ticket and the one being served, or the end
+  // of an MCS lock's queue and the holder's place in it
+  atomic_uint     ticket_next;
+  atomic_uint     ticket_serving;
+  _Atomic(struct mcs_node_t*) mcs_tail;
+  struct mcs_node_t* mcs_holder;
+
+  // sanity check allocations
+  size_t          arena_size;
+
+  // the node at the end of the arena
+  struct node_t*  last_node;
+
+  // end of the memory the arena may use. A mapped heap's arenas only
+  // commit some of it, and grow and shrink a chunk at a time keeping
+  // spare_bytes free at the end. chunk_size is 0 for other heaps.
+  uintptr_t       arena_end;
+  size_t          chunk_size;
+  size_t          spare_bytes;
+
+  struct node_t*  bins[BIN_COUNT];
+  uint64_t        bin_map[BIN_MAP_WORDS];
+
+  // root of the size tree, only kept up if sorted is set
+  struct node_t*  size_tree;
+  int             sorted;
+
+  // set for the buddy system, every node is a power of two
+  // in size, header included, and aligned to its size
+  int             buddy;
+
+  // blocks freed by threads using other arenas, linked through their
+  // memory and released by whoever next takes the lock. If deferred
+  // is set every free goes here, and they are only released by the
+  // reclaimer or an allocation that would otherwise fail.
+  _Atomic(struct node_t*) pending_frees;
+  int             deferred;
+
+  // put in the prev_free link of every block on the pending free list,
+  // so freeing one again can be caught. It's different for every arena
+  // ever set up, so one left in memory by an old heap doesn't match.
+  struct node_t*  pending_key;
+
+  // memory at the end of the arena that no node has been made from
+  // yet, if the heap has a wilderness. Nodes are carved off it at
+  // wild_top without the lock, and linked in at wild_base next time
+  // the arena is locked. wild_top is 0 while that happens, and for
+  // good once the rest has been added to the arena.
+  _Atomic uintptr_t wild_top;
+  atomic_uint     wild_carving;
+  uintptr_t       wild_base;
+  uintptr_t       wild_end;
+
+  // statistics for heap_get_stats(), only changed with the
+  // lock held but atomic so they can be read without it
+  atomic_size_t   node_count;
+  atomic_size_t   committed;
+  atomic_size_t   free_bytes;
+  atomic_size_t   free_blocks;
+  atomic_size_t   largest_free;
+  int             largest_stale;
+  atomic_ullong   lock_waits;
+  atomic_ullong   lock_wait_ns;
+
+  // counted for the threads using this arena, without the lock
+  atomic_size_t   allocations;
+  atomic_size_t   deallocations;
+  atomic_size_t   failed_allocations;
+};
+
+// adds to a statistic that is only changed with the lock held,
+// so there's no need for an atomic add
+#define STAT_ADD(stat, n) \
+  atomic_store_explicit(&(stat), atomic_load_explicit(&(stat), memory_order_relaxed) + (n), \
+                        memory_order_relaxed)
+
+// adds to a statistic that any thread may change
+#define STAT_COUNT(stat, n) \
+  atomic_fetch_add_explicit(&(stat), (n), memory_order_relaxed)
 
-//pointer to lastused/next node
-static struct node_t* next_node;
+// most arenas a heap can be split into
+#define MAX_ARENAS 64
+
+// how often the reclaimer drains deferred frees
+#define RECLAIM_INTERVAL_NS 1000000
+
+// everything we need to manage one heap
+struct heap_t
+{
+  // algorithm used to find free nodes, set when the heap is created
+  struct node_t*  (*find_node)(struct arena_t* arena, size_t bytes, size_t alignment);
+
+  // the heap's memory is split evenly between its arenas,
+  // so we can work out which arena an address is in
+  struct arena_t* arenas;
+  unsigned        arena_count;
+  unsigned        arena_policy;
+  uintptr_t       arena_base;
+  size_t          arena_span;
+
+  // sanity check deallocations
+  size_t          heap_size;
+
+  // address space reserved by heap_create_mapped() or
+  // initialise_mapped(), NULL if the user gave us the memory
+  void*           mapping;
+  size_t          mapping_size;
+
+  // blocks this big get a mapping of their own
+  size_t          mmap_threshold;
+
+  // whether the heap's memory should be in huge pages
+  unsigned        huge_pages;
+
+  // with ARENA_BY_NODE, arena i is on node i % numa_nodes
+  unsigned        numa_nodes;
+  unsigned        numa_simulated;
+  atomic_size_t   mapped_blocks;
+  atomic_size_t   mapped_bytes;
+
+  // whether arenas start with a wilderness to carve nodes from
+  unsigned        wilderness;
+
+  // what kind of lock the arenas have
+  unsigned        lock_policy;
+
+  // with deferred frees, a thread that drains the arenas'
+  // pending frees every RECLAIM_INTERVAL_NS
+  unsigned        deferred_frees;
+  unsigned        reclaiming;
+  int             reclaim_stop;
+  pthread_t       reclaimer;
+  pthread_mutex_t reclaim_lock;
+  pthread_cond_t  reclaim_wake;
+
+  // a heap with one arena doesn't need any of its memory for arenas
+  struct arena_t  first_arena;
+
+  // unique to this heap, so thread caches can tell when
+  // the heap they were filled from has gone
+  unsigned long   generation;
+
+  // all live heaps are kept in a list
+  struct heap_t*  next_heap;
+};
 
-//So it doesn't screw up when using threads.
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// the heap used by initialise, allocate and deallocate
+static struct heap_t default_heap;
 
-// sanity check allocations
-static size_t heap_size;
+// list of live heaps and a lock for it
+static struct heap_t*  heaps;
+static pthread_mutex_t heaps_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void* (*allocate)(size_t bytes);
-void* allocate_first_fit(size_t bytes);
-void* allocate_next_fit(size_t bytes);
-void* allocate_best_fit(size_t bytes);
-void* allocate_worst_fit(size_t bytes);
 
 
 /*...........................................................................*/
-/*..                          DEBUGGING / VALIDATION                       ..*/
+/*..                          NODE LAYOUT                                  ..*/
 /*...........................................................................*/
 
-// macros
-#ifdef _DEBUG
-  #define PRINTF                        printf
-  #define PRINT_NODE(p)          print_node(p)
-  #define PRINT_ALL_NODES()  print_all_nodes()
-  #define VALIDATE()                validate()
-  #define VALIDATE_NODE(p)    validate_node(p)
-#else
-  #define PRINTF
-  #define PRINT_NODE(p)
-  #define PRINT_ALL_NODES()
-#endif
+// everything else goes through these, so it doesn't matter which way
+// nodes are laid out. All but node_size and node_is_free must be
+// called with the arena's lock held.
 
-// if this fails, somethings gone wrong
-// so use assert to tell the user.
-void validate_node(struct node_t* p)
+#ifdef COMPACT_HEADERS
+
+// an arena can lose this much lining up its first node
+#define ARENA_PADDING (2 * sizeof(struct free_links_t))
+
+// headers only change with the lock held, so relaxed is enough
+static size_t node_header(struct node_t* p)
 {
-  assert(p->next == NULL || p->next->prev == p);
-  assert(p->prev == NULL || p->prev->next == p);
-  assert(p->size > 0);
+  return atomic_load_explicit(&p->header, memory_order_relaxed);
 }
 
-void validate()
+static void node_set_header(struct node_t* p, size_t header)
 {
-  pthread_mutex_lock(&lock);
-  struct node_t* p = linked_list;
-  size_t counter = 0;
+  atomic_store_explicit(&p->header, header, memory_order_relaxed);
+}
 
-  while (p)
-  {
-    validate_node(p);
-    counter += p->size + sizeof(struct node_t);
-    p = p->next;
-  }
+static size_t node_size(struct node_t* p)
+{
+  return node_header(p) & ~NODE_FLAGS;
+}
 
-  // at any given point, nodes should sum to heap size.
-  assert(counter == heap_size);
-  pthread_mutex_unlock(&lock);
+static int node_is_free(struct node_t* p)
+{
+  return (node_header(p) & NODE_FREE) != 0;
 }
 
-void print_node(struct node_t* p)
+// whether p has a mapping of its own rather than being in an arena
+static int node_is_mapped(struct node_t* p)
 {
-  printf("address[%10p] | " ,p);
-  printf("size[%9zu] | "   ,p->size);
-  printf("free[%1d]" ,p->free);
-  if (next_node == p)
-    printf(" <-");
-  printf("\n");
+  return (node_header(p) & NODE_MAPPED) != 0;
 }
 
-void print_all_nodes()
+// the node after p, or NULL if p is the last in the arena
+static struct node_t* node_next(struct arena_t* arena, struct node_t* p)
 {
-  pthread_mutex_lock(&lock);
-  struct node_t* p = linked_list;
-  int i = 0;
-  while(p)
-  {
-    printf("node[%5d] | ",i++);
-    print_node(p);
-    p = p->next;
-  }
-  pthread_mutex_unlock(&lock);
+  uintptr_t next = (uintptr_t)p->memory + node_size(p);
+  uintptr_t end  = (uintptr_t)arena->linked_list + arena->arena_size;
+  return next < end ? (struct node_t*)next : NULL;
 }
 
-/*...........................................................................*/
-/*..                          COMMON FUNCTIONS                             ..*/
-/*...........................................................................*/
+// the node before p if it is free, its size is in the word before p
+static struct node_t* node_prev_free(struct node_t* p)
+{
+  if (!(node_header(p) & NODE_PREV_FREE))
+    return NULL;
+
+  size_t size = ((size_t*)p)[-1];
+  return (struct node_t*)((uint8_t*)p - size - sizeof(struct node_t));
+}
 
+// brings p's boundary tag and the next node's flag up to date
+static void node_sync(struct arena_t* arena, struct node_t* p)
+{
+  struct node_t* next = node_next(arena, p);
 
-// dont leave empty blocks less than this or we could
-// end up with a heap full of small blocks that cant/wont be allocated
-#define MINIMUM_FREE_BLOCK 32
-#define MINIMUM_HEAP_SIZE 1024
+  if (node_is_free(p))
+    ((size_t*)&p->memory[node_size(p)])[-1] = node_size(p);
+
+  if (next && node_is_free(p))
+    node_set_header(next, node_header(next) | NODE_PREV_FREE);
+  else if (next)
+    node_set_header(next, node_header(next) & ~NODE_PREV_FREE);
+}
 
 /**
 *
-* Creates a node at a given memory address
+* Creates a free node at a given memory address
 *
 * @param memory : Address of memory where node is to be created.
 * @param size : The size of the new node
@@ -152,417 +381,4826 @@ static struct node_t* create_node(void* memory, size_t size)
   assert(size > sizeof(struct node_t));
 
   struct node_t* p = (struct node_t*)memory;
+  node_set_header(p, (size - sizeof(struct node_t)) | NODE_FREE);
+  ((size_t*)&p->memory[node_size(p)])[-1] = node_size(p);
+  return p;
+}
+
+// creates an allocated node that isn't in any arena
+static struct node_t* create_mapped_node(void* memory, size_t size)
+{
+  struct node_t* p = (struct node_t*)memory;
+  node_set_header(p, (size - sizeof(struct node_t)) | NODE_MAPPED);
+  return p;
+}
 
-  // node info
-  p->next = NULL;
-  p->prev = NULL;
-  p->free = 1;
-  p->size = size - sizeof(struct node_t);
+// creates an allocated node that isn't linked into its arena yet
+static struct node_t* create_used_node(void* memory, size_t size)
+{
+  struct node_t* p = (struct node_t*)memory;
+  node_set_header(p, size - sizeof(struct node_t));
   return p;
 }
 
+static void node_set_size(struct arena_t* arena, struct node_t* p, size_t size)
+{
+  node_set_header(p, size | (node_header(p) & NODE_FLAGS));
+  node_sync(arena, p);
+}
+
+static void node_set_free(struct arena_t* arena, struct node_t* p, int free)
+{
+  if (free)
+    node_set_header(p, node_header(p) | NODE_FREE);
+  else
+    node_set_header(p, node_header(p) & ~NODE_FREE);
+
+  node_sync(arena, p);
+}
 
 /**
 *
-* Allocates memory for a given node
+* Splits a node in two, the new node after it is in use
 *
-* @param p : Pointer to the node you want to allocate
-* @param size : The amount of memory to be allocated
+* @param arena : The arena the node belongs to
+* @param p : Pointer to the node to split
+* @param bytes : How much memory p keeps
 *
-* @return Pointer to a new allocated node.
+* @return Pointer to the new node.
 *
 */
-static struct node_t* allocate_node(struct node_t* p, size_t bytes)
+static struct node_t* node_split(struct arena_t* arena, struct node_t* p, size_t bytes)
 {
-  assert(p);
-  assert(bytes > 0);
+  struct node_t* node = (struct node_t*)&p->memory[bytes];
+  node_set_header(node, node_size(p) - bytes - sizeof(struct node_t));
 
-  // calculate memory left over after allocation
-  size_t remaining = p->size - bytes;
+  if (arena->last_node == p)
+    arena->last_node = node;
 
-  if (remaining >= sizeof(struct node_t) + MINIMUM_FREE_BLOCK)
-  {
-    // create a new node with the remaining memory
-    struct node_t* node = create_node(&p->memory[bytes], remaining);
+  node_set_size(arena, p, bytes);
+  node_sync(arena, node);
+  return node;
+}
 
-    //update next and previous pointers for the new/current node
-    node->next = p->next;
-    node->prev = p;
+// p takes over the node after it
+static void node_join_next(struct arena_t* arena, struct node_t* p)
+{
+  struct node_t* next = node_next(arena, p);
 
-    if (node->next)
-      node->next->prev = node;
+  if (arena->last_node == next)
+    arena->last_node = p;
 
-    p->next = node;
-    p->size = bytes;
-  }
+  node_set_size(arena, p, node_size(p) + sizeof(struct node_t) + node_size(next));
+}
 
-  // mark as free and zero the memory
-  p->free = 0;
-  memset(p->memory, 0, p->size);
+// p, just after the end of the arena, becomes its last node
+static void node_append(struct arena_t* arena, struct node_t* p)
+{
+  struct node_t* last = arena->last_node;
 
-  return p;
+  arena->arena_size += sizeof(struct node_t) + node_size(p);
+  arena->last_node = p;
+  node_sync(arena, last);
+}
+
+#else
+
+#define ARENA_PADDING 0
+
+static size_t node_size(struct node_t* p)
+{
+  return p->size;
+}
+
+static int node_is_free(struct node_t* p)
+{
+  return p->free;
+}
+
+// whether p has a mapping of its own rather than being in an arena
+static int node_is_mapped(struct node_t* p)
+{
+  return p->mapped;
 }
 
+// the node after p, or NULL if p is the last in the arena
+static struct node_t* node_next(struct arena_t* arena, struct node_t* p)
+{
+  (void)arena;
+  return p->next;
+}
+
+// the node before p if it is free
+static struct node_t* node_prev_free(struct node_t* p)
+{
+  return p->prev && p->prev->free ? p->prev : NULL;
+}
 
 /**
 *
-* Merges a given node with its previous node
+* Creates a free node at a given memory address
 *
-* @param memory : Pointer to node to merge
+* @param memory : Address of memory where node is to be created.
+* @param size : The size of the new node
 *
-* @return Pointer to the new merged node.
+* @return Pointer to a new node.
 *
 */
-static struct node_t* merge_prev(struct node_t* p)
+static struct node_t* create_node(void* memory, size_t size)
 {
-  assert(p);
+  assert(memory);
+  assert(size > sizeof(struct node_t));
 
-  // point to node after removed node
-  p->prev->next = p->next;
+  struct node_t* p = (struct node_t*)memory;
 
-  //adjust size of previous node
-  p->prev->size += sizeof(struct node_t) + p->size;
+  // node info
+  p->next = NULL;
+  p->prev = NULL;
+  p->free = 1;
+  p->mapped = 0;
+  p->size = size - sizeof(struct node_t);
+  return p;
+}
 
-  if (p->next)
-    p->next->prev = p->prev;
+// creates an allocated node that isn't in any arena
+static struct node_t* create_mapped_node(void* memory, size_t size)
+{
+  struct node_t* p = create_node(memory, size);
+  p->free = 0;
+  p->mapped = 1;
+  return p;
+}
 
-  // current node should not exist, so return previous
-  return p->prev;
+// creates an allocated node that isn't linked into its arena yet
+static struct node_t* create_used_node(void* memory, size_t size)
+{
+  struct node_t* p = create_node(memory, size);
+  p->free = 0;
+  return p;
+}
+
+static void node_set_size(struct arena_t* arena, struct node_t* p, size_t size)
+{
+  (void)arena;
+  p->size = size;
 }
 
+static void node_set_free(struct arena_t* arena, struct node_t* p, int free)
+{
+  (void)arena;
+  p->free = free;
+}
 
 /**
 *
-* Merges a given node with its next node
+* Splits a node in two, the new node after it is in use
 *
-* @param memory : Pointer to node to merge
+* @param arena : The arena the node belongs to
+* @param p : Pointer to the node to split
+* @param bytes : How much memory p keeps
 *
-* @return Pointer to the new merged node.
+* @return Pointer to the new node.
 *
 */
-static struct node_t* merge_next(struct node_t* p)
+static struct node_t* node_split(struct arena_t* arena, struct node_t* p, size_t bytes)
 {
-  assert(p);
+  // create a new node with the remaining memory
+  struct node_t* node = create_node(&p->memory[bytes], p->size - bytes);
+
+  //update next and previous pointers for the new/current node
+  node->next = p->next;
+  node->prev = p;
+  node->free = 0;
+
+  if (node->next)
+    node->next->prev = node;
+  else
+    arena->last_node = node;
+
+  p->next = node;
+  p->size = bytes;
+  return node;
+}
 
+// p takes over the node after it
+static void node_join_next(struct arena_t* arena, struct node_t* p)
+{
   // adjust size of current node
   p->size += sizeof(struct node_t) + p->next->size;
-  
+
   p->next = p->next->next;
 
   if (p->next)
     p->next->prev = p;
-
-  return p;
+  else
+    arena->last_node = p;
 }
 
-// initilizes memory manager
-// full description in header file
-void initialise(void* memory, size_t size, char* algorithm)
+// p, just after the end of the arena, becomes its last node
+static void node_append(struct arena_t* arena, struct node_t* p)
 {
-  // memory cannot be NULL
-  // memor has to be of a minimum size
-  assert(memory);
-  assert(size > MINIMUM_HEAP_SIZE);
+  p->prev = arena->last_node;
+  p->next = NULL;
+  arena->last_node->next = p;
+  arena->last_node = p;
+  arena->arena_size += sizeof(struct node_t) + node_size(p);
+}
 
-  // create a node containg all of free memory and point our list at it
-  struct node_t* p = create_node(memory, size);
+#endif
 
-  heap_size   = size;
 
-  // change head of linked list to point to this node
-  linked_list = p;
+/*...........................................................................*/
+/*..                          DEBUGGING / VALIDATION                       ..*/
+/*...........................................................................*/
 
-  // we dont have a next/last-used node yet
-  next_node   = NULL;
+// macros
+#ifdef _DEBUG
+  #define PRINTF                        printf
+  #define PRINT_NODE(p)          print_node(p)
+  #define PRINT_ALL_NODES()  print_all_nodes()
+  #define VALIDATE()                validate()
+  #define VALIDATE_NODE(p)    validate_node(p)
+#else
+  #define PRINTF
+  #define PRINT_NODE(p)
+  #define PRINT_ALL_NODES()
+#endif
 
-  // change allocate function pointer accordingly
-  if (!algorithm || strcmp(algorithm, FIRSTFIT) == 0)
-  {
-    allocate = allocate_first_fit;
-  }
-  else if (strcmp(algorithm, NEXTFIT) == 0)
-  {
-    allocate = allocate_next_fit;
-  }
-  else if (strcmp(algorithm, BESTFIT) == 0)
-  {
-    allocate = allocate_best_fit;
-  }
-  else if (strcmp(algorithm, WORSTFIT) == 0)
-  {
-    allocate = allocate_worst_fit;
-  } 
-  else
-  {
-    fprintf(stderr, "Error : Unknown algorithm type\n");
-    exit(EXIT_FAILURE);
-  }
+// record allocations when tracing is compiled in
+#ifdef MM_TRACE
+  #define TRACE(op, size, alignment, old_block, block) \
+    trace_record(op, size, alignment, old_block, block)
+#else
+  #define TRACE(op, size, alignment, old_block, block)
+#endif
+
+static void arena_lock(struct arena_t* arena);
+static void drain_pending(struct arena_t* arena);
+static int  arena_grow(struct arena_t* arena, size_t bytes);
+static int  wild_release(struct arena_t* arena);
+static size_t wild_left(struct arena_t* arena);
+static void arena_unlock(struct arena_t* arena);
+
+// if this fails, somethings gone wrong
+// so use assert to tell the user.
+void validate_node(struct arena_t* arena, struct node_t* p)
+{
+#ifdef COMPACT_HEADERS
+  struct node_t* next = node_next(arena, p);
+
+  // free nodes end with their size, and the next node knows they're free
+  if (node_is_free(p))
+    assert(((size_t*)&p->memory[node_size(p)])[-1] == node_size(p));
+  assert(next == NULL || !(node_header(next) & NODE_PREV_FREE) == !node_is_free(p));
+#else
+  (void)arena;
+  assert(p->next == NULL || p->next->prev == p);
+  assert(p->prev == NULL || p->prev->next == p);
+#endif
+  assert(node_size(p) > 0);
 }
 
-// Deallocates memory
-// we need to also make sure we check if we are 
-// destorying our last used node
-// full description in header file
-void deallocate(void* memory)
-{  
-  pthread_mutex_lock(&lock);
+static unsigned bin_index(size_t size);
 
-  // if deallocate was called before initialise
-  assert(linked_list);
+// every free node should be in the bin for its size
+// and every node in a bin should be free
+static void validate_bins(struct arena_t* arena, size_t free_nodes)
+{
+  size_t counter = 0;
 
-  // should be ok to pass in NULL
-  if (memory == NULL)
+  for (unsigned i = 0; i < BIN_COUNT; i++)
   {
-    pthread_mutex_unlock(&lock);
-    return;
+    struct node_t* p = arena->bins[i];
+
+    // bin map bit must match whether the bin is empty
+    assert(!(arena->bin_map[i / BIN_MAP_BITS] & ((uint64_t)1 << (i % BIN_MAP_BITS))) == !p);
+
+    while (p)
+    {
+      assert(node_is_free(p));
+      assert(bin_index(node_size(p)) == i);
+      assert(FREE_LINKS(p)->next_free == NULL ||
+        FREE_LINKS(FREE_LINKS(p)->next_free)->prev_free == p);
+      counter++;
+      p = FREE_LINKS(p)->next_free;
+    }
   }
 
+  assert(counter == free_nodes);
+}
 
-  // check memory is is in heaps address space
-  assert((uintptr_t)memory >= (uintptr_t)linked_list &&
-    (uintptr_t)memory < (uintptr_t)linked_list + (uintptr_t)heap_size);
+static uint64_t tree_priority(struct node_t* p);
+static int tree_less(struct node_t* a, struct node_t* b);
+static struct node_t* buddy_of(struct arena_t* arena, struct node_t* p);
 
-  // memory is a pointer to the data so recover the header
-  struct node_t* p = ((struct node_t*)memory) - 1;
+// a buddy block is a power of two in size and at a multiple
+// of it, and it shouldn't be free if its buddy is
+static void validate_buddy(struct arena_t* arena, struct node_t* p)
+{
+  size_t block = node_size(p) + sizeof(struct node_t);
+  struct node_t* buddy = buddy_of(arena, p);
+
+  assert((block & (block - 1)) == 0 && block >= BUDDY_MIN_BLOCK);
+  assert(((uintptr_t)p - (uintptr_t)arena->linked_list) % block == 0);
+  assert(!node_is_free(p) || buddy == NULL || !node_is_free(buddy) ||
+         node_size(buddy) != node_size(p));
+}
+
+// the size tree should be in order, with parents having a higher
+// priority than their children, returns how many nodes it has
+static size_t validate_tree(struct node_t* p, struct node_t* parent)
+{
+  if (p == NULL)
+    return 0;
+
+  struct tree_links_t* links = TREE_LINKS(p);
+
+  assert(node_is_free(p) && node_size(p) >= TREE_MIN_SIZE);
+  assert(links->parent == parent);
+  assert(parent == NULL || tree_priority(p) <= tree_priority(parent));
+  assert(links->left == NULL || tree_less(links->left, p));
+  assert(links->right == NULL || tree_less(p, links->right));
 
+  return 1 + validate_tree(links->left, p) + validate_tree(links->right, p);
+}
+
+static void validate_arena(struct arena_t* arena)
+{
+  arena_lock(arena);
+  struct node_t* p = arena->linked_list;
+  size_t counter = 0;
+  size_t nodes = 0;
+  size_t free_nodes = 0;
+  size_t free_bytes = 0;
+  size_t largest_free = 0;
+  size_t tree_nodes = 0;
+  struct node_t* last = NULL;
 
-  // memory block should have been marked as in use
-  // if it isnt we cant trust this block
-  //assert(!p->free);
-  if (p->free)
+  while (p)
   {
-	  fprintf(stderr, "Error : memory already free\n");
-	  pthread_mutex_unlock(&lock);
-	  return;
+    validate_node(arena, p);
+    if (arena->buddy)
+      validate_buddy(arena, p);
+    last = p;
+    counter += node_size(p) + sizeof(struct node_t);
+    nodes++;
+    if (node_is_free(p))
+    {
+      free_nodes++;
+      free_bytes += node_size(p);
+      if (node_size(p) > largest_free)
+        largest_free = node_size(p);
+      if (node_size(p) >= TREE_MIN_SIZE)
+        tree_nodes++;
+    }
+    p = node_next(arena, p);
   }
 
+  // at any given point, nodes should sum to heap size.
+  assert(counter == arena->arena_size);
+  assert(last == arena->last_node);
+  assert((uintptr_t)arena->linked_list + arena->arena_size <= arena->arena_end);
 
-  // make node free
-  p->free = 1;
+  // the wilderness starts where the nodes end
+  assert(arena->wild_base <= arena->wild_end);
+  assert(arena->wild_base == arena->wild_end ||
+         arena->wild_base == (uintptr_t)arena->linked_list + arena->arena_size);
 
-  // check prev block, increase size of prev if so
-  if (p->prev && p->prev->free)
-  {
-    // Make sure we dont destroy our next/last used node
-    if (next_node == p)
-      next_node = p->next; // prev;
+  // the statistics should have kept up
+  assert(atomic_load(&arena->node_count) == nodes);
+  assert(atomic_load(&arena->committed) == arena->arena_size);
+  assert(atomic_load(&arena->free_blocks) == free_nodes);
+  assert(atomic_load(&arena->free_bytes) == free_bytes);
+  assert(atomic_load(&arena->largest_free) == largest_free);
 
-    p = merge_prev(p);
-  }
+  validate_bins(arena, free_nodes);
+  if (arena->sorted)
+    assert(validate_tree(arena->size_tree, NULL) == tree_nodes);
+  else
+    assert(arena->size_tree == NULL);
+  arena_unlock(arena);
+}
 
-  // check next block, and merg it if its free
-  if (p->next && p->next->free)
+void heap_validate(struct heap_t* heap)
+{
+  for (unsigned i = 0; i < heap->arena_count; i++)
   {
-    // Make sure we dont destroy our next/last used node
-    if (next_node == p->next)
-      next_node = p->next->next;
+    struct arena_t* arena = &heap->arenas[i];
+    uintptr_t start = heap->arena_base + i * heap->arena_span;
+    size_t span = i == heap->arena_count - 1 ?
+      heap->heap_size - i * heap->arena_span : heap->arena_span;
 
-    merge_next(p);
+    // arenas should be in order and fill their share of the heap,
+    // less anything lost lining up the first node or not yet committed
+    assert((uintptr_t)arena->linked_list >= start);
+    assert(arena->arena_end == start + span);
+    validate_arena(arena);
+    assert(arena->chunk_size || span - arena->arena_size - (arena->wild_end - arena->wild_base) <=
+      (arena->buddy ? ARENA_PADDING + BUDDY_ALIGNMENT + BUDDY_MIN_BLOCK : ARENA_PADDING));
   }
-  pthread_mutex_unlock(&lock);
 }
 
-/*...........................................................................*/
-/*..                  ALLOCATION ALGORITHMS                                ..*/
-/*...........................................................................*/
+void validate()
+{
+  heap_validate(&default_heap);
+}
 
+void print_node(struct arena_t* arena, struct node_t* p)
+{
+  printf("address[%10p] | " ,p);
+  printf("size[%9zu] | "   ,node_size(p));
+  printf("free[%1d]" ,node_is_free(p));
+  if (arena->next_node == p)
+    printf(" <-");
+  printf("\n");
+}
 
-/**
- *
- * Returns a segment of dynamically allocated memory of the specified size.
- *
- * Uses the first free memory block that meets our size requirements.
- *
- * @param bytes : Bytes of memory to allocate
- *
- * @return Pointer to new block of memory
- *
-*/
-void* allocate_first_fit(size_t bytes)
+void heap_print_all_nodes(struct heap_t* heap)
 {
-  pthread_mutex_lock(&lock);
-  assert(bytes > 0);
+  for (unsigned n = 0; n < heap->arena_count; n++)
+  {
+    struct arena_t* arena = &heap->arenas[n];
 
-  // start at head of list
-  struct node_t* p = linked_list;
+    if (heap->arena_count > 1)
+      printf("arena[%3u]\n", n);
 
-  // allocate called before initialise
-  assert(p);
+    arena_lock(arena);
+    struct node_t* p = arena->linked_list;
+    int i = 0;
+    while(p)
+    {
+      printf("node[%5d] | ",i++);
+      print_node(arena, p);
+      p = node_next(arena, p);
+    }
+    arena_unlock(arena);
+  }
+}
 
-  while (p)
+void print_all_nodes()
+{
+  heap_print_all_nodes(&default_heap);
+}
+
+void heap_get_usage(struct heap_t* heap, heap_usage_t* usage)
+{
+  assert(usage);
+  memset(usage, 0, sizeof(*usage));
+  usage->heap_size = heap->heap_size;
+
+  for (unsigned n = 0; n < heap->arena_count; n++)
   {
-    // check its avavilable and we have room to allocate memory
-    if (p->free && p->size >= bytes)
+    struct arena_t* arena = &heap->arenas[n];
+
+    arena_lock(arena);
+    struct node_t* p = arena->linked_list;
+    while (p)
     {
-      allocate_node(p, bytes);
-      pthread_mutex_unlock(&lock);
-      return p->memory;
+      if (node_is_free(p))
+      {
+        usage->free_bytes += node_size(p);
+        usage->free_blocks++;
+        if (node_size(p) > usage->largest_free)
+          usage->largest_free = node_size(p);
+      }
+      else
+        usage->used_bytes += node_size(p);
+      p = node_next(arena, p);
     }
 
-    // go to next node
-    p = p->next;
+    // nodes carved since the lock was taken are left out
+    size_t wild = wild_left(arena);
+    if (wild > sizeof(struct node_t))
+    {
+      usage->free_bytes += wild - sizeof(struct node_t);
+      usage->free_blocks++;
+      if (wild - sizeof(struct node_t) > usage->largest_free)
+        usage->largest_free = wild - sizeof(struct node_t);
+    }
+    arena_unlock(arena);
   }
-  pthread_mutex_unlock(&lock);
-  return NULL;
 }
 
+void get_usage(heap_usage_t* usage)
+{
+  heap_get_usage(&default_heap, usage);
+}
 
-/**
- *
- * Returns a segment of dynamically allocated memory of the specified size.
- *
- * Uses the first free memory block that meets our size
- * requirements. But starts at the last used memory segment.
- *
- * @param bytes : Bytes of memory to allocate
- *
- * @return Pointer to new block of memory
- *
-*/
-void* allocate_next_fit(size_t bytes)
+// reads the counters every arena keeps, without locking
+void heap_get_stats(struct heap_t* heap, heap_stats_t* stats)
 {
-  pthread_mutex_lock(&lock);
-  assert(bytes > 0);
+  assert(stats);
+  memset(stats, 0, sizeof(*stats));
+  stats->heap_size = heap->heap_size;
 
-  // start at last used node
-  struct node_t* p = next_node;
+  size_t nodes = 0;
+  size_t size = 0;
 
-  // if null then start at head of linked list
-  if (p == NULL)
-    p = linked_list;
+  for (unsigned n = 0; n < heap->arena_count; n++)
+  {
+    struct arena_t* arena = &heap->arenas[n];
+    size_t largest = atomic_load_explicit(&arena->largest_free, memory_order_relaxed);
 
-  // remember where we are
-  struct node_t* posn = p;
+    size                      += atomic_load_explicit(&arena->committed, memory_order_relaxed);
+    nodes                     += atomic_load_explicit(&arena->node_count, memory_order_relaxed);
+    stats->free_bytes         += atomic_load_explicit(&arena->free_bytes, memory_order_relaxed);
+    stats->free_blocks        += atomic_load_explicit(&arena->free_blocks, memory_order_relaxed);
+    stats->allocations        += atomic_load_explicit(&arena->allocations, memory_order_relaxed);
+    stats->deallocations      += atomic_load_explicit(&arena->deallocations, memory_order_relaxed);
+    stats->failed_allocations += atomic_load_explicit(&arena->failed_allocations, memory_order_relaxed);
+    stats->lock_waits         += atomic_load_explicit(&arena->lock_waits, memory_order_relaxed);
+    stats->lock_wait_ns       += atomic_load_explicit(&arena->lock_wait_ns, memory_order_relaxed);
 
-  // this shouldn't be null
-  assert(posn);
+    if (largest > stats->largest_free)
+      stats->largest_free = largest;
 
-  // go through list until back to where we started
-  do
-  {
-    // check its avavilable and we have room to allocate memory
-    if (p->free && p->size >= bytes)
+    // the wilderness counts as one free node
+    size_t wild = wild_left(arena);
+    if (wild > sizeof(struct node_t))
     {
-      allocate_node(p, bytes);
-
-      // update last used to next node as we know p is now not free
-      next_node = p->next;
-      pthread_mutex_unlock(&lock);
-      return p->memory;
+      size  += wild;
+      nodes += 1;
+      stats->free_bytes  += wild - sizeof(struct node_t);
+      stats->free_blocks += 1;
+      if (wild - sizeof(struct node_t) > stats->largest_free)
+        stats->largest_free = wild - sizeof(struct node_t);
     }
+  }
 
-    //reset to head of linked list
-    p = p->next;
-    if (p == NULL)
-      p = linked_list;
+  // everything that isn't a header or free is in use, the counters
+  // can be read part way through an allocation so don't go below 0
+  size_t overhead = nodes * sizeof(struct node_t) + stats->free_bytes;
+  stats->used_bytes = overhead < size ? size - overhead : 0;
 
-  } while (p != posn);
+  stats->mapped_blocks = atomic_load_explicit(&heap->mapped_blocks, memory_order_relaxed);
+  stats->mapped_bytes  = atomic_load_explicit(&heap->mapped_bytes, memory_order_relaxed);
+}
 
-  pthread_mutex_unlock(&lock);
-  return NULL;
+void get_stats(heap_stats_t* stats)
+{
+  heap_get_stats(&default_heap, stats);
 }
 
+/*...........................................................................*/
+/*..                          COMMON FUNCTIONS                             ..*/
+/*...........................................................................*/
+
+
+// dont leave empty blocks less than this or we could
+// end up with a heap full of small blocks that cant/wont be allocated,
+// can be set when compiling to tune it against a trace
+#ifndef MINIMUM_FREE_BLOCK
+  #define MINIMUM_FREE_BLOCK 32
+#endif
+#define MINIMUM_HEAP_SIZE 1024
+
+// every allocation is rounded up to this, it keeps nodes aligned
+// and means a freed block always has room for its bin links
+#define MEMORY_ALIGNMENT sizeof(struct free_links_t)
+
+// a node in the size tree has room for its links and, with compact
+// headers, its size at the end
+_Static_assert(TREE_MIN_SIZE >= sizeof(struct free_links_t) + sizeof(struct tree_links_t) +
+               sizeof(size_t), "TREE_MIN_SIZE is too small for the tree links");
+
+// a free block split off the end of a node needs room for its bin links
+_Static_assert(MINIMUM_FREE_BLOCK >= sizeof(struct free_links_t),
+               "MINIMUM_FREE_BLOCK is too small for the links of a free node");
+
+#ifdef COMPACT_HEADERS
+  // smallest memory a node can have, its bin links and size when free
+  #define MINIMUM_NODE_MEMORY (sizeof(struct free_links_t) + sizeof(size_t))
+
+  _Static_assert(MINIMUM_FREE_BLOCK >= MINIMUM_NODE_MEMORY,
+                 "MINIMUM_FREE_BLOCK is too small for the links and size of a free node");
+#endif
 
 /**
- *
- * Returns a segment of dynamically allocated memory of the specified size.
- *
- * Uses the smallest possible memory block that fits our size requirements.
- *
- * @param bytes : Bytes of memory to allocate
- *
- * @return Pointer to new block of memory
- *
+*
+* Rounds a requested size up to something we can allocate
+*
+* @param bytes : The amount of memory requested
+*
+* @return The amount of memory to allocate.
+*
 */
-void* allocate_best_fit(size_t bytes)
+static size_t request_size(size_t bytes)
 {
-  pthread_mutex_lock(&lock);
-  assert(bytes > 0);
+  // too big to round, nothing will fit it anyway
+  if (bytes > SIZE_MAX - 2 * MEMORY_ALIGNMENT)
+    return SIZE_MAX;
 
-  // start at head of list
-  struct node_t* p = linked_list;
+#ifdef COMPACT_HEADERS
+  // the header and memory together are a multiple of the alignment,
+  // and a freed block needs room for its bin links and size
+  if (bytes < MINIMUM_NODE_MEMORY)
+    bytes = MINIMUM_NODE_MEMORY;
 
-  // allocate called before initialise
-  assert(p);
+  bytes += sizeof(struct node_t);
+  return ((bytes + MEMORY_ALIGNMENT - 1) & ~(MEMORY_ALIGNMENT - 1)) - sizeof(struct node_t);
+#else
+  return (bytes + MEMORY_ALIGNMENT - 1) & ~(MEMORY_ALIGNMENT - 1);
+#endif
+}
 
-  size_t size = heap_size;
 
-  // current smallest node
-  struct node_t* smallest = NULL;
+// monotonic time in nanoseconds, for timing locks
+static uint64_t now_ns()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
 
-  // first go through all nodes and find the smallest valid node
-  while (p)
-  {
-    if (p->free && p->size >= bytes && p->size < size)
-    {
-      smallest = p;
-      size = p->size;
-    }
+/*...........................................................................*/
+/*..                          INSTRUMENTATION                              ..*/
+/*...........................................................................*/
 
-    p = p->next;
-  }
+// when built with MM_INSTRUMENT every thread keeps log2 histograms
+// of request sizes, nodes visited per search, and how long it waited
+// for and held arena locks. get_instrument_report() adds them up.
 
-  // if we found a valid node
-  if (smallest)
-  {
-    p = allocate_node(smallest, bytes);
-    pthread_mutex_unlock(&lock);
-    return p->memory;
-  }
+#ifdef MM_INSTRUMENT
 
-  // nothing found so return NULL
-  pthread_mutex_unlock(&lock);
-  return NULL;
+enum
+{
+  INSTRUMENT_SIZE,
+  INSTRUMENT_WALK,
+  INSTRUMENT_LOCK_WAIT,
+  INSTRUMENT_LOCK_HOLD,
+  INSTRUMENT_HISTOGRAMS
+};
+
+// one thread's histograms, only that thread changes them
+struct instrument_t
+{
+  atomic_ullong         histograms[INSTRUMENT_HISTOGRAMS][HISTOGRAM_BUCKETS];
+  struct instrument_t*  next;
+};
+
+// every thread's histograms, and the totals of threads that have exited
+static struct instrument_t* instruments;
+static struct instrument_t  retired;
+static pthread_mutex_t      instruments_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t        instrument_key;
+static pthread_once_t       instrument_once = PTHREAD_ONCE_INIT;
+
+static __thread struct instrument_t* instrument;
+
+// set once the thread's histograms have been retired
+static __thread int instrument_retired;
+
+// nodes looked at by the current search, and when
+// the thread got the arena lock it's holding
+static __thread size_t   nodes_visited;
+static __thread uint64_t lock_acquired;
+
+#define INSTRUMENT(histogram, value) instrument_record(histogram, value)
+#define VISIT_NODE()                 nodes_visited++
+
+// bucket 0 is for 0, bucket n for 2^(n-1) up to 2^n - 1
+static unsigned histogram_bucket(uint64_t value)
+{
+  return value ? 64 - __builtin_clzll(value) : 0;
+}
+
+// adds a thread's histograms to the totals when it exits
+static void instrument_retire(void* data)
+{
+  struct instrument_t* thread = data;
+
+  pthread_mutex_lock(&instruments_lock);
+
+  for (unsigned h = 0; h < INSTRUMENT_HISTOGRAMS; h++)
+    for (unsigned b = 0; b < HISTOGRAM_BUCKETS; b++)
+      STAT_ADD(retired.histograms[h][b], atomic_load(&thread->histograms[h][b]));
+
+  struct instrument_t** i = &instruments;
+  while (*i != thread)
+    i = &(*i)->next;
+  *i = thread->next;
+
+  pthread_mutex_unlock(&instruments_lock);
+  free(thread);
+
+  // other destructors, like the thread cache's, may still take locks
+  // and record them. There may not be another destructor pass to
+  // retire new histograms, so they go straight into the totals.
+  instrument = NULL;
+  instrument_retired = 1;
 }
 
+static void instrument_create_key()
+{
+  pthread_key_create(&instrument_key, instrument_retire);
+}
 
 /**
- *
- * Returns a segment of dynamically allocated memory of the specified size.
- *
- * Uses the largest possible memory block that fits our size requirements.
- *
- * @param bytes : Bytes of memory to allocate
- *
- * @return Pointer to new block of memory
- *
+*
+* Counts a value in one of the calling thread's histograms
+*
+* @param histogram : Which histogram
+* @param value : The value to count
+*
 */
-void* allocate_worst_fit(size_t bytes)
+static void instrument_record(unsigned histogram, uint64_t value)
 {
-  pthread_mutex_lock(&lock);
+  if (instrument_retired)
+  {
+    STAT_ADD(retired.histograms[histogram][histogram_bucket(value)], 1);
+    return;
+  }
 
-  assert(bytes > 0);
+  if (instrument == NULL)
+  {
+    instrument = calloc(1, sizeof(struct instrument_t));
+    assert(instrument);
 
-  // start at beginning of list
-  struct node_t* p = linked_list;
+    pthread_once(&instrument_once, instrument_create_key);
+    pthread_setspecific(instrument_key, instrument);
 
-  size_t size = bytes - 1;
-  struct node_t* largest = NULL;
+    pthread_mutex_lock(&instruments_lock);
+    instrument->next = instruments;
+    instruments = instrument;
+    pthread_mutex_unlock(&instruments_lock);
+  }
 
-  // allocate called before initialise
-  assert(p);
+  STAT_ADD(instrument->histograms[histogram][histogram_bucket(value)], 1);
+}
 
-  // first go through all nodes and find the largest valid node
-  while (p)
+#else
+  #define INSTRUMENT(histogram, value)
+  #define VISIT_NODE()
+#endif
+
+
+// adds up every thread's histograms
+// full description in header file
+void get_instrument_report(instrument_report_t* report)
+{
+  assert(report);
+  memset(report, 0, sizeof(*report));
+
+#ifdef MM_INSTRUMENT
+  unsigned long long* totals[INSTRUMENT_HISTOGRAMS] =
+  {
+    report->request_sizes, report->nodes_visited,
+    report->lock_wait_ns, report->lock_hold_ns
+  };
+
+  pthread_mutex_lock(&instruments_lock);
+
+  for (unsigned h = 0; h < INSTRUMENT_HISTOGRAMS; h++)
   {
-    if (p->free && p->size > size)
+    for (unsigned b = 0; b < HISTOGRAM_BUCKETS; b++)
     {
-      largest = p;
-      size = p->size;
+      totals[h][b] = atomic_load_explicit(&retired.histograms[h][b], memory_order_relaxed);
+      for (struct instrument_t* i = instruments; i; i = i->next)
+        totals[h][b] += atomic_load_explicit(&i->histograms[h][b], memory_order_relaxed);
     }
-
-    p = p->next;
   }
 
-  // if we found a valid node
-  if (largest)
+  pthread_mutex_unlock(&instruments_lock);
+#endif
+}
+
+
+#ifdef MM_INSTRUMENT
+static void print_histogram(const char* name, const unsigned long long* histogram)
+{
+  unsigned long long total = 0;
+  for (unsigned b = 0; b < HISTOGRAM_BUCKETS; b++)
+    total += histogram[b];
+
+  printf("%s, %llu samples\n", name, total);
+
+  for (unsigned b = 0; b < HISTOGRAM_BUCKETS; b++)
   {
-    p = allocate_node(largest, bytes);
-    pthread_mutex_unlock(&lock);
-    return p->memory;
+    if (histogram[b] == 0)
+      continue;
+
+    unsigned long long low  = b ? 1ULL << (b - 1) : 0;
+    unsigned long long high = b ? low * 2 - 1 : 0;
+    printf("  [%12llu, %12llu] | %12llu | %5.1f%%\n",
+           low, high, histogram[b], 100.0 * histogram[b] / total);
   }
+}
+#endif
 
-  // nothing found so return NULL
-  pthread_mutex_unlock(&lock);
-  return NULL;
-}
\ No newline at end of file
+
+// full description in header file
+void print_instrument_report()
+{
+#ifdef MM_INSTRUMENT
+  instrument_report_t report;
+  get_instrument_report(&report);
+
+  print_histogram("request size (bytes)", report.request_sizes);
+  print_histogram("nodes visited per search", report.nodes_visited);
+  print_histogram("lock wait (ns)", report.lock_wait_ns);
+  print_histogram("lock hold (ns)", report.lock_hold_ns);
+#else
+  printf("instrumentation not compiled in, build with -DMM_INSTRUMENT\n");
+#endif
+}
+
+/*...........................................................................*/
+/*..                          SIZE TREE                                    ..*/
+/*...........................................................................*/
+
+// best and worst fit keep free nodes of TREE_MIN_SIZE or more in a
+// treap, a binary search tree that is also a heap on a random priority,
+// which keeps it balanced on average. Smaller nodes are left to the
+// bins, which below TREE_MIN_SIZE only hold one size each because sizes
+// differ by MEMORY_ALIGNMENT. The priority is a hash of the address so
+// it doesn't need storing.
+
+static uint64_t tree_priority(struct node_t* p)
+{
+  return ((uint64_t)(uintptr_t)p >> 4) * 0x9E3779B97F4A7C15ULL;
+}
+
+// the tree is ordered by size, then address
+static int tree_less(struct node_t* a, struct node_t* b)
+{
+  if (node_size(a) != node_size(b))
+    return node_size(a) < node_size(b);
+  return (uintptr_t)a < (uintptr_t)b;
+}
+
+
+/**
+*
+* Puts a node where a child of parent used to be
+*
+* @param arena : The arena the tree belongs to
+* @param parent : The parent, NULL for the root
+* @param old : The child being replaced
+* @param node : The node to put there, may be NULL
+*
+*/
+static void tree_replace(struct arena_t* arena, struct node_t* parent,
+                         struct node_t* old, struct node_t* node)
+{
+  if (parent == NULL)
+    arena->size_tree = node;
+  else if (TREE_LINKS(parent)->left == old)
+    TREE_LINKS(parent)->left = node;
+  else
+    TREE_LINKS(parent)->right = node;
+
+  if (node)
+    TREE_LINKS(node)->parent = parent;
+}
+
+
+/**
+*
+* Rotates a node up into its parent's place
+*
+* @param arena : The arena the tree belongs to
+* @param x : The node, which must have a parent
+*
+*/
+static void tree_rotate_up(struct arena_t* arena, struct node_t* x)
+{
+  struct tree_links_t* xl = TREE_LINKS(x);
+  struct node_t* p = xl->parent;
+  struct tree_links_t* pl = TREE_LINKS(p);
+  struct node_t* g = pl->parent;
+
+  if (pl->left == x)
+  {
+    pl->left = xl->right;
+    if (xl->right)
+      TREE_LINKS(xl->right)->parent = p;
+    xl->right = p;
+  }
+  else
+  {
+    pl->right = xl->left;
+    if (xl->left)
+      TREE_LINKS(xl->left)->parent = p;
+    xl->left = p;
+  }
+
+  pl->parent = x;
+  tree_replace(arena, g, p, x);
+}
+
+
+/**
+*
+* Adds a free node to the size tree
+*
+* @param arena : The arena the node belongs to
+* @param p : Pointer to the free node
+*
+*/
+static void tree_insert(struct arena_t* arena, struct node_t* p)
+{
+  struct tree_links_t* links = TREE_LINKS(p);
+  struct node_t* parent = NULL;
+  struct node_t* q = arena->size_tree;
+
+  while (q)
+  {
+    parent = q;
+    q = tree_less(p, q) ? TREE_LINKS(q)->left : TREE_LINKS(q)->right;
+  }
+
+  links->left   = NULL;
+  links->right  = NULL;
+  links->parent = parent;
+
+  if (parent == NULL)
+    arena->size_tree = p;
+  else if (tree_less(p, parent))
+    TREE_LINKS(parent)->left = p;
+  else
+    TREE_LINKS(parent)->right = p;
+
+  // rotate it up until its parent has a higher priority
+  while (links->parent && tree_priority(p) > tree_priority(links->parent))
+    tree_rotate_up(arena, p);
+}
+
+
+/**
+*
+* Removes a free node from the size tree
+*
+* @param arena : The arena the node belongs to
+* @param p : Pointer to the free node
+*
+*/
+static void tree_remove(struct arena_t* arena, struct node_t* p)
+{
+  struct tree_links_t* links = TREE_LINKS(p);
+
+  // rotate it down until it has at most one child
+  while (links->left && links->right)
+  {
+    struct node_t* child = tree_priority(links->left) > tree_priority(links->right) ?
+      links->left : links->right;
+    tree_rotate_up(arena, child);
+  }
+
+  tree_replace(arena, links->parent, p, links->left ? links->left : links->right);
+}
+
+
+/**
+*
+* Finds the smallest node in the size tree with at least a given
+* amount of memory, the one with the lowest address if there's a tie
+*
+* @param arena : The arena to search
+* @param bytes : The amount of memory needed
+*
+* @return Pointer to the node or NULL if there isn't one.
+*
+*/
+static struct node_t* tree_lower_bound(struct arena_t* arena, size_t bytes)
+{
+  struct node_t* found = NULL;
+  struct node_t* q = arena->size_tree;
+
+  while (q)
+  {
+    VISIT_NODE();
+    if (node_size(q) >= bytes)
+    {
+      found = q;
+      q = TREE_LINKS(q)->left;
+    }
+    else
+      q = TREE_LINKS(q)->right;
+  }
+  return found;
+}
+
+
+// the biggest node in the size tree, NULL if it's empty
+static struct node_t* tree_last(struct arena_t* arena)
+{
+  struct node_t* q = arena->size_tree;
+
+  while (q && TREE_LINKS(q)->right)
+    q = TREE_LINKS(q)->right;
+  return q;
+}
+
+
+/**
+*
+* Steps through the size tree in order
+*
+* @param p : Pointer to a node in the tree
+* @param forward : Non-zero for the next bigger node, zero for the next smaller
+*
+* @return Pointer to the node or NULL if p was the last one.
+*
+*/
+static struct node_t* tree_step(struct node_t* p, int forward)
+{
+  struct node_t* child = forward ? TREE_LINKS(p)->right : TREE_LINKS(p)->left;
+
+  // the far end of the subtree on that side
+  if (child)
+  {
+    for (;;)
+    {
+      struct node_t* next = forward ? TREE_LINKS(child)->left : TREE_LINKS(child)->right;
+      if (next == NULL)
+        return child;
+      child = next;
+    }
+  }
+
+  // otherwise the first ancestor we're on the other side of
+  struct node_t* parent = TREE_LINKS(p)->parent;
+  while (parent && (forward ? TREE_LINKS(parent)->right : TREE_LINKS(parent)->left) == p)
+  {
+    p = parent;
+    parent = TREE_LINKS(p)->parent;
+  }
+  return parent;
+}
+
+
+/*...........................................................................*/
+/*..                          SIZE-CLASS BINS                              ..*/
+/*...........................................................................*/
+
+// each power of two is split into 4 size classes
+#define BIN_SUBDIVISIONS_LOG2 2
+#define BIN_SUBDIVISIONS (1 << BIN_SUBDIVISIONS_LOG2)
+
+/**
+*
+* Finds which bin a free node of a given size belongs in
+*
+* @param size : The size of the node's memory
+*
+* @return Index of the bin.
+*
+*/
+static unsigned bin_index(size_t size)
+{
+  assert(size >= BIN_SUBDIVISIONS);
+
+  // position of the highest set bit
+  unsigned msb = 63 - __builtin_clzll((unsigned long long)size);
+
+  // the next bits pick the subdivision within that power of two
+  unsigned sub = (size >> (msb - BIN_SUBDIVISIONS_LOG2)) & (BIN_SUBDIVISIONS - 1);
+
+  return ((msb - BIN_SUBDIVISIONS_LOG2) << BIN_SUBDIVISIONS_LOG2) + sub;
+}
+
+
+/**
+*
+* Finds the smallest size that belongs in a given bin
+*
+* @param index : Index of the bin
+*
+* @return Smallest size of a node in that bin.
+*
+*/
+static size_t bin_lower_bound(unsigned index)
+{
+  unsigned msb = (index >> BIN_SUBDIVISIONS_LOG2) + BIN_SUBDIVISIONS_LOG2;
+  size_t   sub = index & (BIN_SUBDIVISIONS - 1);
+
+  return ((size_t)1 << msb) + (sub << (msb - BIN_SUBDIVISIONS_LOG2));
+}
+
+
+/**
+*
+* Adds a free node to the front of its bin
+*
+* @param arena : The arena the node belongs to
+* @param p : Pointer to the free node
+*
+*/
+static void bin_insert(struct arena_t* arena, struct node_t* p)
+{
+  assert(p && node_is_free(p));
+
+  unsigned i = bin_index(node_size(p));
+
+  FREE_LINKS(p)->prev_free = NULL;
+  FREE_LINKS(p)->next_free = arena->bins[i];
+
+  if (arena->bins[i])
+    FREE_LINKS(arena->bins[i])->prev_free = p;
+
+  arena->bins[i] = p;
+  arena->bin_map[i / BIN_MAP_BITS] |= (uint64_t)1 << (i % BIN_MAP_BITS);
+
+  if (arena->sorted && node_size(p) >= TREE_MIN_SIZE)
+    tree_insert(arena, p);
+
+  STAT_ADD(arena->free_bytes, node_size(p));
+  STAT_ADD(arena->free_blocks, 1);
+  if (node_size(p) > atomic_load_explicit(&arena->largest_free, memory_order_relaxed))
+    atomic_store_explicit(&arena->largest_free, node_size(p), memory_order_relaxed);
+}
+
+
+/**
+*
+* Finds the size of the biggest free node, it's in
+* the last bin that isn't empty
+*
+* @param arena : The arena to search
+*
+* @return Size of the biggest free node, 0 if there aren't any.
+*
+*/
+static size_t bin_largest(struct arena_t* arena)
+{
+  for (unsigned word = BIN_MAP_WORDS; word-- > 0; )
+  {
+    if (!arena->bin_map[word])
+      continue;
+
+    unsigned i = word * BIN_MAP_BITS + 63 - __builtin_clzll(arena->bin_map[word]);
+    size_t largest = 0;
+
+    for (struct node_t* p = arena->bins[i]; p; p = FREE_LINKS(p)->next_free)
+    {
+      if (node_size(p) > largest)
+        largest = node_size(p);
+    }
+    return largest;
+  }
+
+  return 0;
+}
+
+
+/**
+*
+* Removes a free node from its bin
+*
+* @param arena : The arena the node belongs to
+* @param p : Pointer to the free node
+*
+*/
+static void bin_remove(struct arena_t* arena, struct node_t* p)
+{
+  assert(p && node_is_free(p));
+
+  unsigned i = bin_index(node_size(p));
+  struct free_links_t* links = FREE_LINKS(p);
+
+  if (links->prev_free)
+    FREE_LINKS(links->prev_free)->next_free = links->next_free;
+  else
+    arena->bins[i] = links->next_free;
+
+  if (links->next_free)
+    FREE_LINKS(links->next_free)->prev_free = links->prev_free;
+
+  // clear the map bit if the bin is now empty
+  if (arena->bins[i] == NULL)
+    arena->bin_map[i / BIN_MAP_BITS] &= ~((uint64_t)1 << (i % BIN_MAP_BITS));
+
+  if (arena->sorted && node_size(p) >= TREE_MIN_SIZE)
+    tree_remove(arena, p);
+
+  STAT_ADD(arena->free_bytes, -node_size(p));
+  STAT_ADD(arena->free_blocks, -1);
+
+  // the biggest node is found again when the lock is released, by
+  // then the rest of an allocated node is usually back in its bin
+  if (node_size(p) == atomic_load_explicit(&arena->largest_free, memory_order_relaxed))
+    arena->largest_stale = 1;
+}
+
+
+/**
+*
+* Finds the first non empty bin at or after a given bin
+*
+* @param arena : The arena to search
+* @param index : Index of the bin to start at
+*
+* @return Index of the bin, or BIN_COUNT if they are all empty.
+*
+*/
+static unsigned bin_next_non_empty(struct arena_t* arena, unsigned index)
+{
+  unsigned word = index / BIN_MAP_BITS;
+
+  if (word >= BIN_MAP_WORDS)
+    return BIN_COUNT;
+
+  // ignore bins before index in the first word
+  uint64_t bits = arena->bin_map[word] & (~(uint64_t)0 << (index % BIN_MAP_BITS));
+
+  while (!bits)
+  {
+    if (++word == BIN_MAP_WORDS)
+      return BIN_COUNT;
+    bits = arena->bin_map[word];
+  }
+
+  return word * BIN_MAP_BITS + __builtin_ctzll(bits);
+}
+
+
+/**
+*
+* Finds a free node with at least a given amount of memory
+*
+* Any node in a bin above the request's own bin is big enough, so we
+* take the first one from the bin map. Only if there are none do we
+* search the request's own bin, which may hold smaller nodes.
+*
+* @param arena : The arena to search
+* @param bytes : The amount of memory needed
+*
+* @return Pointer to a free node or NULL if there isn't one.
+*
+*/
+static struct node_t* bin_find(struct arena_t* arena, size_t bytes)
+{
+  unsigned i = bin_index(bytes);
+
+  // if bytes is the smallest size in its bin, every node in it fits
+  unsigned start = bin_lower_bound(i) == bytes ? i : i + 1;
+  unsigned found = bin_next_non_empty(arena, start);
+
+  if (found < BIN_COUNT)
+  {
+    VISIT_NODE();
+    return arena->bins[found];
+  }
+
+  // check the request's own bin
+  struct node_t* p = arena->bins[i];
+  while (p)
+  {
+    VISIT_NODE();
+    if (node_size(p) >= bytes)
+      return p;
+    p = FREE_LINKS(p)->next_free;
+  }
+
+  return NULL;
+}
+
+
+/*...........................................................................*/
+/*..                          NODE FUNCTIONS                               ..*/
+/*...........................................................................*/
+
+/**
+*
+* Allocates memory for a given node
+*
+* @param arena : The arena the node belongs to
+* @param p : Pointer to the node you want to allocate
+* @param size : The amount of memory to be allocated
+*
+* @return Pointer to a new allocated node.
+*
+*/
+static struct node_t* allocate_node(struct arena_t* arena, struct node_t* p, size_t bytes)
+{
+  assert(p);
+  assert(bytes > 0);
+
+  // it's no longer free, so take it out of its bin
+  bin_remove(arena, p);
+
+  // calculate memory left over after allocation
+  size_t remaining = node_size(p) - bytes;
+
+  // mark as in use, the memory is zeroed by the caller
+  // if it needs to be, once the lock has been released
+  node_set_free(arena, p, 0);
+
+  if (remaining >= sizeof(struct node_t) + MINIMUM_FREE_BLOCK)
+  {
+    // create a new node with the remaining memory
+    struct node_t* node = node_split(arena, p, bytes);
+    node_set_free(arena, node, 1);
+
+    STAT_ADD(arena->node_count, 1);
+    bin_insert(arena, node);
+  }
+
+  return p;
+}
+
+
+/**
+*
+* Merges a given node with its previous node
+*
+* The previous node is free, so it is taken out of its bin. The merged
+* node isn't in any bin, the caller decides where it goes.
+*
+* @param arena : The arena the node belongs to
+* @param memory : Pointer to node to merge
+*
+* @return Pointer to the new merged node.
+*
+*/
+static struct node_t* merge_prev(struct arena_t* arena, struct node_t* p)
+{
+  assert(p);
+
+  struct node_t* prev = node_prev_free(p);
+  bin_remove(arena, prev);
+
+  // previous node takes over this one
+  node_join_next(arena, prev);
+
+  STAT_ADD(arena->node_count, -1);
+
+  // current node should not exist, so return previous
+  return prev;
+}
+
+
+/**
+*
+* Merges a given node with its next node
+*
+* The next node is free, so it is taken out of its bin.
+*
+* @param arena : The arena the node belongs to
+* @param memory : Pointer to node to merge
+*
+* @return Pointer to the new merged node.
+*
+*/
+static struct node_t* merge_next(struct arena_t* arena, struct node_t* p)
+{
+  assert(p);
+
+  bin_remove(arena, node_next(arena, p));
+
+  // current node takes over the next one
+  node_join_next(arena, p);
+
+  STAT_ADD(arena->node_count, -1);
+  return p;
+}
+
+/*...........................................................................*/
+/*..                          BUDDY SYSTEM                                 ..*/
+/*...........................................................................*/
+
+// a buddy arena's nodes are blocks of a power of two bytes, header
+// included, each at an offset from the start of the arena that is a
+// multiple of its size. Splitting a block gives two halves that are
+// each other's buddy, and a freed block is only ever merged with its
+// buddy, found from its address. Free blocks of each size have a bin
+// of their own, so the bin map says which sizes have free blocks.
+
+
+/**
+*
+* Works out the size of block an allocation needs
+*
+* @param bytes : Bytes of memory needed
+* @param alignment : What the memory has to be aligned to, 1 for anything
+*
+* @return Size of the block, header included, or 0 if it's too big.
+*
+*/
+static size_t buddy_block(size_t bytes, size_t alignment)
+{
+  if (bytes > SIZE_MAX / 4)
+    return 0;
+
+  size_t need  = bytes + sizeof(struct node_t);
+  size_t block = BUDDY_MIN_BLOCK;
+
+  if (alignment <= BUDDY_ALIGNMENT && need < alignment)
+    need = alignment;
+
+  while (block < need)
+    block <<= 1;
+  return block;
+}
+
+
+/**
+*
+* Finds a block's buddy
+*
+* @param arena : The arena the block belongs to
+* @param p : Pointer to the block's node
+*
+* @return Pointer to the buddy's node, NULL if it would be past the end
+*         of the arena.
+*
+*/
+static struct node_t* buddy_of(struct arena_t* arena, struct node_t* p)
+{
+  uintptr_t base  = (uintptr_t)arena->linked_list;
+  size_t    block = node_size(p) + sizeof(struct node_t);
+  uintptr_t buddy = base + (((uintptr_t)p - base) ^ block);
+
+  if (buddy + block > base + arena->arena_size)
+    return NULL;
+  return (struct node_t*)buddy;
+}
+
+
+/**
+*
+* Splits the arena's one free node into blocks, biggest first, so
+* every block is at a multiple of its size. Called by arena_init.
+*
+* @param arena : The arena, its size a multiple of BUDDY_MIN_BLOCK
+*
+*/
+static void buddy_tile(struct arena_t* arena)
+{
+  struct node_t* p = arena->linked_list;
+  bin_remove(arena, p);
+
+  for (;;)
+  {
+    size_t size  = node_size(p) + sizeof(struct node_t);
+    size_t block = (size_t)1 << (63 - __builtin_clzll((unsigned long long)size));
+
+    if (block == size)
+      break;
+
+    struct node_t* node = node_split(arena, p, block - sizeof(struct node_t));
+    node_set_free(arena, node, 1);
+    STAT_ADD(arena->node_count, 1);
+    bin_insert(arena, p);
+    p = node;
+  }
+
+  bin_insert(arena, p);
+
+  // taking out the whole arena left it stale
+  atomic_store_explicit(&arena->largest_free, bin_largest(arena), memory_order_relaxed);
+  arena->largest_stale = 0;
+}
+
+
+/**
+*
+* Allocates a free block, splitting it in half until it's as small as
+* the allocation allows. The top halves are freed.
+* Must be called with the arena's lock held.
+*
+* @param arena : The arena the block belongs to
+* @param p : Pointer to the free block
+* @param bytes : Bytes of memory to allocate, already rounded
+* @param alignment : What the memory has to be aligned to, 1 for anything
+*
+* @return Pointer to the allocated node.
+*
+*/
+static struct node_t* buddy_allocate(struct arena_t* arena, struct node_t* p,
+                                     size_t bytes, size_t alignment)
+{
+  size_t block = buddy_block(bytes, alignment);
+
+  bin_remove(arena, p);
+  node_set_free(arena, p, 0);
+
+  while (node_size(p) + sizeof(struct node_t) > block)
+  {
+    size_t half = (node_size(p) + sizeof(struct node_t)) / 2;
+    struct node_t* node = node_split(arena, p, half - sizeof(struct node_t));
+
+    node_set_free(arena, node, 1);
+    STAT_ADD(arena->node_count, 1);
+    bin_insert(arena, node);
+  }
+
+  return p;
+}
+
+
+/**
+*
+* Frees a block, merging it with its buddy for as long as the buddy
+* is free and hasn't been split. Must be called with the arena's lock held.
+*
+* @param arena : The arena the block belongs to
+* @param p : Pointer to the block's node
+*
+*/
+static void buddy_release(struct arena_t* arena, struct node_t* p)
+{
+  node_set_free(arena, p, 1);
+
+  for (;;)
+  {
+    struct node_t* buddy = buddy_of(arena, p);
+
+    if (buddy == NULL || !node_is_free(buddy) || node_size(buddy) != node_size(p))
+      break;
+
+    // the merged block starts at whichever is first
+    bin_remove(arena, buddy);
+    if (buddy < p)
+      p = buddy;
+
+    node_join_next(arena, p);
+    STAT_ADD(arena->node_count, -1);
+  }
+
+  bin_insert(arena, p);
+}
+
+
+/**
+*
+* Shrinks an allocated block by freeing its top half for as long as
+* the bottom half is still big enough.
+* Must be called with the arena's lock held.
+*
+* @param arena : The arena the block belongs to
+* @param p : Pointer to the allocated node
+* @param bytes : The size to shrink it to, already rounded
+*
+*/
+static void buddy_shrink(struct arena_t* arena, struct node_t* p, size_t bytes)
+{
+  size_t block = buddy_block(bytes, 1);
+
+  while (node_size(p) + sizeof(struct node_t) > block)
+  {
+    size_t half = (node_size(p) + sizeof(struct node_t)) / 2;
+    struct node_t* node = node_split(arena, p, half - sizeof(struct node_t));
+
+    STAT_ADD(arena->node_count, 1);
+    buddy_release(arena, node);
+  }
+}
+
+
+/**
+*
+* Grows an allocated block by merging it with its buddies, which is
+* only possible while it is the bottom half and they are free and
+* whole. Must be called with the arena's lock held.
+*
+* @param arena : The arena the block belongs to
+* @param p : Pointer to the allocated node
+* @param bytes : The size it needs to grow to, already rounded
+*
+* @return Whether it grew.
+*
+*/
+static int buddy_grow(struct arena_t* arena, struct node_t* p, size_t bytes)
+{
+  size_t    block  = buddy_block(bytes, 1);
+  uintptr_t base   = (uintptr_t)arena->linked_list;
+  size_t    offset = (uintptr_t)p - base;
+
+  if (block == 0)
+    return 0;
+
+  // check every buddy before merging any of them
+  for (size_t size = node_size(p) + sizeof(struct node_t); size < block; size <<= 1)
+  {
+    struct node_t* buddy = (struct node_t*)(base + offset + size);
+
+    if ((offset & size) || offset + 2 * size > arena->arena_size ||
+        !node_is_free(buddy) || node_size(buddy) != size - sizeof(struct node_t))
+      return 0;
+  }
+
+  while (node_size(p) + sizeof(struct node_t) < block)
+  {
+    bin_remove(arena, node_next(arena, p));
+    node_join_next(arena, p);
+    STAT_ADD(arena->node_count, -1);
+  }
+
+  return 1;
+}
+
+
+/*...........................................................................*/
+/*..                  ALLOCATION ALGORITHMS                                ..*/
+/*...........................................................................*/
+
+// these are all called with the lock held, they find a free node
+// with room for a given number of bytes and return NULL if there isn't one
+
+
+/**
+*
+* Works out where the memory of an aligned allocation would go in a
+* free node. If the node's own memory isn't aligned, the allocation
+* has to go far enough in to leave a free node in front of it.
+*
+* @param p : Pointer to the free node
+* @param bytes : Bytes of memory needed
+* @param alignment : What the memory has to be aligned to
+*
+* @return Address of the memory, or 0 if it doesn't fit.
+*
+*/
+static uintptr_t aligned_memory(struct node_t* p, size_t bytes, size_t alignment)
+{
+  uintptr_t start = (uintptr_t)p->memory;
+  uintptr_t end   = start + node_size(p);
+  uintptr_t a     = (start + alignment - 1) & ~(alignment - 1);
+
+  // leave room for a node in front
+  if (a != start)
+  {
+    a = start + sizeof(struct node_t) + MINIMUM_FREE_BLOCK;
+    a = (a + alignment - 1) & ~(alignment - 1);
+  }
+
+  if (a > end || end - a < bytes)
+    return 0;
+
+  return a;
+}
+
+
+/**
+*
+* Checks if an allocation fits in a free node
+*
+* @param p : Pointer to the free node
+* @param bytes : Bytes of memory needed
+* @param alignment : What the memory has to be aligned to, 1 for anything
+*
+* @return Whether it fits.
+*
+*/
+static int node_fits(struct node_t* p, size_t bytes, size_t alignment)
+{
+  if (alignment == 1)
+    return node_size(p) >= bytes;
+
+  return aligned_memory(p, bytes, alignment) != 0;
+}
+
+
+/**
+ *
+ * Uses the first free memory block that meets our size requirements.
+ *
+ * @param arena : The arena to search
+ * @param bytes : Bytes of memory needed
+ * @param alignment : What the memory has to be aligned to
+ *
+ * @return Pointer to a free node
+ *
+*/
+static struct node_t* find_first_fit(struct arena_t* arena, size_t bytes, size_t alignment)
+{
+  // start at head of list
+  struct node_t* p = arena->linked_list;
+
+  while (p)
+  {
+    VISIT_NODE();
+
+    // check its avavilable and we have room to allocate memory
+    if (node_is_free(p) && node_fits(p, bytes, alignment))
+      return p;
+
+    // go to next node
+    p = node_next(arena, p);
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ * Uses the first free memory block that meets our size
+ * requirements. But starts at the last used memory segment.
+ *
+ * @param arena : The arena to search
+ * @param bytes : Bytes of memory needed
+ * @param alignment : What the memory has to be aligned to
+ *
+ * @return Pointer to a free node
+ *
+*/
+static struct node_t* find_next_fit(struct arena_t* arena, size_t bytes, size_t alignment)
+{
+  // start at last used node
+  struct node_t* p = arena->next_node;
+
+  // if null then start at head of linked list
+  if (p == NULL)
+    p = arena->linked_list;
+
+  // remember where we are
+  struct node_t* posn = p;
+
+  // go through list until back to where we started
+  do
+  {
+    VISIT_NODE();
+
+    // check its avavilable and we have room to allocate memory
+    if (node_is_free(p) && node_fits(p, bytes, alignment))
+      return p;
+
+    //reset to head of linked list
+    p = node_next(arena, p);
+    if (p == NULL)
+      p = arena->linked_list;
+
+  } while (p != posn);
+
+  return NULL;
+}
+
+
+/**
+*
+* Looks for a node that fits in one of the bins below TREE_MIN_SIZE.
+* Each holds one size, so the first node that fits is as good as any.
+*
+* @param arena : The arena to search
+* @param i : Index of the bin
+* @param bytes : Bytes of memory needed
+* @param alignment : What the memory has to be aligned to
+*
+* @return Pointer to a free node or NULL if none of them fit.
+*
+*/
+static struct node_t* small_bin_fit(struct arena_t* arena, unsigned i, size_t bytes, size_t alignment)
+{
+  for (struct node_t* p = arena->bins[i]; p; p = FREE_LINKS(p)->next_free)
+  {
+    VISIT_NODE();
+    if (node_fits(p, bytes, alignment))
+      return p;
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ * Uses the smallest possible memory block that fits our size requirements.
+ * Small blocks come from the bins, the rest from the size tree.
+ *
+ * @param arena : The arena to search
+ * @param bytes : Bytes of memory needed
+ * @param alignment : What the memory has to be aligned to
+ *
+ * @return Pointer to a free node
+ *
+*/
+static struct node_t* find_best_fit(struct arena_t* arena, size_t bytes, size_t alignment)
+{
+  struct node_t* p;
+
+  // the bins are in size order, so go up them until one has a node that fits
+  for (unsigned i = bin_next_non_empty(arena, bin_index(bytes));
+       i < BIN_COUNT && bin_lower_bound(i) < TREE_MIN_SIZE;
+       i = bin_next_non_empty(arena, i + 1))
+  {
+    if ((p = small_bin_fit(arena, i, bytes, alignment)))
+      return p;
+  }
+
+  // without alignment the first big enough node fits
+  for (p = tree_lower_bound(arena, bytes); p; p = tree_step(p, 1))
+  {
+    VISIT_NODE();
+    if (node_fits(p, bytes, alignment))
+      return p;
+  }
+
+  return NULL;
+}
+
+
+/**
+ *
+ * Uses the largest possible memory block that fits our size requirements.
+ * Big blocks come from the size tree, small ones from the bins.
+ *
+ * @param arena : The arena to search
+ * @param bytes : Bytes of memory needed
+ * @param alignment : What the memory has to be aligned to
+ *
+ * @return Pointer to a free node
+ *
+*/
+static struct node_t* find_worst_fit(struct arena_t* arena, size_t bytes, size_t alignment)
+{
+  struct node_t* p;
+
+  // without alignment the biggest node fits, if any do
+  for (p = tree_last(arena); p && node_size(p) >= bytes; p = tree_step(p, 0))
+  {
+    VISIT_NODE();
+    if (node_fits(p, bytes, alignment))
+      return p;
+  }
+
+  // then down the bins below the tree
+  for (unsigned i = bin_index(TREE_MIN_SIZE); i-- > bin_index(bytes); )
+  {
+    if ((p = small_bin_fit(arena, i, bytes, alignment)))
+      return p;
+  }
+
+  return NULL;
+}
+
+
+/**
+ *
+ * Takes a free node from the size-class bins, so only the bin map and
+ * at most one bin are searched rather than every node.
+ *
+ * @param arena : The arena to search
+ * @param bytes : Bytes of memory needed
+ * @param alignment : What the memory has to be aligned to
+ *
+ * @return Pointer to a free node
+ *
+*/
+static struct node_t* find_segregated_fit(struct arena_t* arena, size_t bytes, size_t alignment)
+{
+  if (alignment == 1)
+    return bin_find(arena, bytes);
+
+  // any node this big has room for the allocation wherever it's aligned
+  size_t worst = bytes + alignment + sizeof(struct node_t) + MINIMUM_FREE_BLOCK;
+  struct node_t* p = bin_find(arena, worst);
+
+  // a node that's already aligned needs no more than bytes
+  if (p == NULL)
+  {
+    p = bin_find(arena, bytes);
+    if (p && !node_fits(p, bytes, alignment))
+      p = NULL;
+  }
+  return p;
+}
+
+
+/**
+ *
+ * Takes a free block from the smallest size that has one and is big
+ * enough, buddy_allocate splits it down to size.
+ *
+ * @param arena : The arena to search
+ * @param bytes : Bytes of memory needed
+ * @param alignment : What the memory has to be aligned to
+ *
+ * @return Pointer to a free node
+ *
+*/
+static struct node_t* find_buddy(struct arena_t* arena, size_t bytes, size_t alignment)
+{
+  size_t block = buddy_block(bytes, alignment);
+  if (block == 0)
+    return NULL;
+
+  for (unsigned i = bin_next_non_empty(arena, bin_index(block - sizeof(struct node_t)));
+       i < BIN_COUNT; i = bin_next_non_empty(arena, i + 1))
+  {
+    // beyond BUDDY_ALIGNMENT a block has to happen to be aligned,
+    // its bottom half always will be too
+    for (struct node_t* p = arena->bins[i]; p; p = FREE_LINKS(p)->next_free)
+    {
+      VISIT_NODE();
+      if (((uintptr_t)p->memory & (alignment - 1)) == 0)
+        return p;
+    }
+  }
+
+  return NULL;
+}
+
+
+/**
+*
+* Runs the heap's algorithm, counting how many nodes it looked at
+* when instrumented. Must be called with the arena's lock held.
+*
+* @param heap : The heap the arena belongs to
+* @param arena : The arena to search
+* @param bytes : Bytes of memory needed
+* @param alignment : What the memory has to be aligned to
+*
+* @return Pointer to a free node
+*
+*/
+static struct node_t* find_node(struct heap_t* heap, struct arena_t* arena, size_t bytes, size_t alignment)
+{
+#ifdef MM_INSTRUMENT
+  nodes_visited = 0;
+  struct node_t* p = heap->find_node(arena, bytes, alignment);
+  INSTRUMENT(INSTRUMENT_WALK, nodes_visited);
+  return p;
+#else
+  return heap->find_node(arena, bytes, alignment);
+#endif
+}
+
+
+/**
+*
+* Splits a free node in two at an aligned address, the node in front
+* stays free. Must be called with the arena's lock held.
+*
+* @param arena : The arena the node belongs to
+* @param p : Pointer to the free node
+* @param memory : Aligned address the second node's memory starts at
+*
+* @return Pointer to the second node.
+*
+*/
+static struct node_t* split_aligned(struct arena_t* arena, struct node_t* p, uintptr_t memory)
+{
+  assert(p && node_is_free(p));
+
+  size_t front = memory - sizeof(struct node_t) - (uintptr_t)p->memory;
+
+  // the node in front gets smaller so it may change bins
+  bin_remove(arena, p);
+
+  struct node_t* node = node_split(arena, p, front);
+  node_set_free(arena, node, 1);
+
+  STAT_ADD(arena->node_count, 1);
+  bin_insert(arena, p);
+  bin_insert(arena, node);
+  return node;
+}
+
+
+/**
+*
+* Finds a free node with the current algorithm and allocates it.
+* Must be called with the arena's lock held.
+*
+* @param heap : The heap the arena belongs to
+* @param arena : The arena to allocate from
+* @param bytes : Bytes of memory to allocate, already rounded
+* @param alignment : What the memory has to be aligned to, 1 for anything
+*
+* @return Pointer to the allocated node or NULL if nothing fits.
+*
+*/
+static struct node_t* take_node(struct heap_t* heap, struct arena_t* arena, size_t bytes, size_t alignment)
+{
+  struct node_t* p = find_node(heap, arena, bytes, alignment);
+
+  // deferred frees might have what we need
+  if (p == NULL && arena->deferred &&
+      atomic_load_explicit(&arena->pending_frees, memory_order_relaxed))
+  {
+    drain_pending(arena);
+    p = find_node(heap, arena, bytes, alignment);
+  }
+
+  // or it's time to stop carving and use the rest of the wilderness
+  if (p == NULL && wild_release(arena))
+    p = find_node(heap, arena, bytes, alignment);
+
+  // a mapped heap can commit more memory, with room for the worst
+  // an aligned allocation might need
+  if (p == NULL && arena->chunk_size &&
+      arena_grow(arena, bytes + alignment + 2 * sizeof(struct node_t) + MINIMUM_FREE_BLOCK))
+    p = find_node(heap, arena, bytes, alignment);
+
+  if (p == NULL)
+    return NULL;
+
+  if (arena->buddy)
+    return buddy_allocate(arena, p, bytes, alignment);
+
+  if (alignment != 1)
+  {
+    uintptr_t memory = aligned_memory(p, bytes, alignment);
+
+    if (memory != (uintptr_t)p->memory)
+      p = split_aligned(arena, p, memory);
+  }
+
+  allocate_node(arena, p, bytes);
+
+  // update last used to next node as we know p is now not free
+  if (heap->find_node == find_next_fit)
+    arena->next_node = node_next(arena, p);
+
+  return p;
+}
+
+
+/**
+*
+* Allocates a number of nodes of the same size. They are carved one
+* after another from a single free node if there is one big enough,
+* otherwise they are found one at a time.
+* Must be called with the arena's lock held.
+*
+* @param heap : The heap the arena belongs to
+* @param arena : The arena to allocate from
+* @param count : How many nodes to allocate
+* @param bytes : Bytes of memory for each node, already rounded
+* @param memory : Where to put the allocated nodes' memory
+*
+* @return How many nodes were allocated.
+*
+*/
+static size_t take_nodes(struct heap_t* heap, struct arena_t* arena,
+                         size_t count, size_t bytes, void** memory)
+{
+  size_t taken  = 0;
+  size_t stride = bytes + sizeof(struct node_t);
+
+  // buddy blocks can't be carved like this
+  if (count > 1 && count <= SIZE_MAX / stride && !arena->buddy)
+  {
+    struct node_t* p = find_node(heap, arena, count * stride - sizeof(struct node_t), 1);
+
+    // each allocation leaves the rest of the node free after it
+    while (p && taken < count)
+    {
+      allocate_node(arena, p, bytes);
+      memory[taken++] = p->memory;
+
+      p = node_next(arena, p);
+      if (p && (!node_is_free(p) || node_size(p) < bytes))
+        p = NULL;
+    }
+
+    if (taken && heap->find_node == find_next_fit)
+      arena->next_node = node_next(arena, ((struct node_t*)memory[taken - 1]) - 1);
+  }
+
+  // get whatever's left one at a time
+  while (taken < count)
+  {
+    struct node_t* p = take_node(heap, arena, bytes, 1);
+    if (p == NULL)
+      break;
+
+    memory[taken++] = p->memory;
+  }
+
+  return taken;
+}
+
+
+/**
+*
+* Frees an allocated node and coalesces it with free neighbours.
+* Must be called with the arena's lock held.
+*
+* We need to also make sure we check if we are
+* destorying our last used node
+*
+* @param arena : The arena the node belongs to
+* @param p : Pointer to the node to free
+*
+*/
+static void release_node(struct arena_t* arena, struct node_t* p)
+{
+  if (arena->buddy)
+  {
+    buddy_release(arena, p);
+    return;
+  }
+
+  // make node free
+  node_set_free(arena, p, 1);
+
+  // check prev block, increase size of prev if so
+  if (node_prev_free(p))
+  {
+    // Make sure we dont destroy our next/last used node
+    if (arena->next_node == p)
+      arena->next_node = node_next(arena, p); // prev;
+
+    p = merge_prev(arena, p);
+  }
+
+  // check next block, and merg it if its free
+  struct node_t* next = node_next(arena, p);
+  if (next && node_is_free(next))
+  {
+    // Make sure we dont destroy our next/last used node
+    if (arena->next_node == next)
+      arena->next_node = node_next(arena, next);
+
+    merge_next(arena, p);
+  }
+
+  // whatever we ended up with goes in a bin
+  bin_insert(arena, p);
+}
+
+
+/**
+*
+* Shrinks an allocated node, anything left over big enough to be
+* a node of its own is freed. Must be called with the arena's lock held.
+*
+* @param arena : The arena the node belongs to
+* @param p : Pointer to the allocated node
+* @param bytes : The size to shrink it to, already rounded
+*
+*/
+static void shrink_node(struct arena_t* arena, struct node_t* p, size_t bytes)
+{
+  assert(p && !node_is_free(p));
+  assert(bytes <= node_size(p));
+
+  if (arena->buddy)
+  {
+    buddy_shrink(arena, p, bytes);
+    return;
+  }
+
+  size_t remaining = node_size(p) - bytes;
+
+  if (remaining < sizeof(struct node_t) + MINIMUM_FREE_BLOCK)
+    return;
+
+  // create a new node with the remaining memory
+  struct node_t* node = node_split(arena, p, bytes);
+  STAT_ADD(arena->node_count, 1);
+
+  // free it so it coalesces with whatever comes after it
+  release_node(arena, node);
+}
+
+
+/**
+*
+* Grows an allocated node into the free node after it, if that
+* gives it enough memory. Must be called with the arena's lock held.
+*
+* @param arena : The arena the node belongs to
+* @param p : Pointer to the allocated node
+* @param bytes : The size it needs to grow to, already rounded
+*
+* @return Whether the node was grown.
+*
+*/
+static int grow_node(struct arena_t* arena, struct node_t* p, size_t bytes)
+{
+  assert(p && !node_is_free(p));
+
+  if (arena->buddy)
+    return buddy_grow(arena, p, bytes);
+
+  struct node_t* next = node_next(arena, p);
+
+  if (next == NULL || !node_is_free(next) ||
+      node_size(p) + sizeof(struct node_t) + node_size(next) < bytes)
+    return 0;
+
+  // Make sure we dont destroy our next/last used node
+  if (arena->next_node == next)
+    arena->next_node = node_next(arena, next);
+
+  merge_next(arena, p);
+
+  // give back whatever we don't need
+  shrink_node(arena, p, bytes);
+  return 1;
+}
+
+
+/*...........................................................................*/
+/*..                          MAPPED HEAPS                                 ..*/
+/*...........................................................................*/
+
+// a mapped heap reserves address space up front and each arena
+// commits chunks of it as it fills up. Free chunks at the end of an
+// arena are given back once more than spare_chunks of them are free,
+// so memory isn't committed and decommitted over and over.
+
+#define DEFAULT_CHUNK_SIZE   (1 << 20)
+#define DEFAULT_SPARE_CHUNKS 1
+
+
+static size_t page_size()
+{
+  return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+
+// size of a transparent huge page
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+/**
+*
+* Asks for memory to be backed by transparent huge pages. Only whole
+* huge pages can be, so anything either side of them is left alone.
+* Does nothing where transparent huge pages aren't supported.
+*
+* @param from : Start of the memory
+* @param to : End of the memory
+*
+*/
+static void memory_advise_huge(uintptr_t from, uintptr_t to)
+{
+#ifdef MADV_HUGEPAGE
+  uintptr_t start = (from + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  uintptr_t end   = to & ~(HUGE_PAGE_SIZE - 1);
+
+  if (end > start)
+    madvise((void*)start, end - start, MADV_HUGEPAGE);
+#else
+  (void)from;
+  (void)to;
+#endif
+}
+
+
+/**
+*
+* Makes memory in a mapping usable, along with the rest of
+* the pages it is on
+*
+* @param from : Start of the memory
+* @param to : End of the memory
+*
+* @return Whether it could be committed.
+*
+*/
+static int memory_commit(uintptr_t from, uintptr_t to)
+{
+  size_t page = page_size();
+  uintptr_t start = from & ~(page - 1);
+  uintptr_t end   = (to + page - 1) & ~(page - 1);
+
+  return mprotect((void*)start, end - start, PROT_READ | PROT_WRITE) == 0;
+}
+
+
+/**
+*
+* Gives back the pages of some memory in a mapping to the OS. Pages
+* that are partly in use, or that go past the end of the arena, are kept.
+*
+* @param from : Start of the memory
+* @param to : End of the memory
+* @param limit : End of the arena the memory belongs to
+*
+*/
+static void memory_decommit(uintptr_t from, uintptr_t to, uintptr_t limit)
+{
+  size_t page = page_size();
+  uintptr_t start = (from + page - 1) & ~(page - 1);
+  uintptr_t end   = (to + page - 1) & ~(page - 1);
+
+  if (end > (limit & ~(page - 1)))
+    end = limit & ~(page - 1);
+
+  if (end > start)
+  {
+    madvise((void*)start, end - start, MADV_DONTNEED);
+    mprotect((void*)start, end - start, PROT_NONE);
+  }
+}
+
+
+/**
+*
+* Adds memory just after the end of an arena to the arena. The last
+* node takes it if that is free or there isn't room for a node of its
+* own, otherwise it becomes a free node.
+* Must be called with the arena's lock held.
+*
+* @param arena : The arena
+* @param bytes : How much memory to add
+*
+*/
+static void arena_extend(struct arena_t* arena, size_t bytes)
+{
+  struct node_t* p = arena->last_node;
+  size_t size = node_size(p);
+
+  arena->arena_size += bytes;
+  STAT_ADD(arena->committed, bytes);
+
+  if (node_is_free(p))
+  {
+    // the last node just gets bigger
+    bin_remove(arena, p);
+    node_set_size(arena, p, size + bytes);
+    bin_insert(arena, p);
+  }
+  else
+  {
+    node_set_size(arena, p, size + bytes);
+
+    // the new memory becomes a free node of its own
+    if (bytes >= sizeof(struct node_t) + MINIMUM_FREE_BLOCK)
+    {
+      struct node_t* node = node_split(arena, p, size);
+      STAT_ADD(arena->node_count, 1);
+      release_node(arena, node);
+    }
+  }
+}
+
+
+/**
+*
+* Commits more of a mapped arena's memory and adds it to the end of
+* the arena as free memory. Must be called with the arena's lock held.
+*
+* @param arena : The arena to grow
+* @param bytes : How much free memory is needed, rounded up to chunks
+*
+* @return Whether the arena grew.
+*
+*/
+static int arena_grow(struct arena_t* arena, size_t bytes)
+{
+  uintptr_t end  = (uintptr_t)arena->linked_list + arena->arena_size;
+  size_t    room = (arena->arena_end - end) & ~(MEMORY_ALIGNMENT - 1);
+  size_t    grow = (bytes + arena->chunk_size - 1) / arena->chunk_size * arena->chunk_size;
+
+  // take whatever is left, it may be enough with the free memory at the end
+  if (bytes > SIZE_MAX - arena->chunk_size || grow > room)
+    grow = room;
+
+  if (grow < sizeof(struct node_t) + MINIMUM_FREE_BLOCK || !memory_commit(end, end + grow))
+    return 0;
+
+  arena_extend(arena, grow);
+  return 1;
+}
+
+
+/**
+*
+* Gives back the chunks at the end of a mapped arena that have been
+* free for a while, keeping spare_bytes of them.
+* Must be called with the arena's lock held.
+*
+* @param arena : The arena to shrink
+*
+*/
+static void arena_trim(struct arena_t* arena)
+{
+  struct node_t* p = arena->last_node;
+
+  if (!node_is_free(p))
+    return;
+
+  // what has to stay free, enough that the node still exists
+  size_t keep = arena->spare_bytes + MINIMUM_FREE_BLOCK;
+  size_t size = node_size(p);
+
+  if (size < keep + arena->chunk_size)
+    return;
+
+  size_t release = (size - keep) / arena->chunk_size * arena->chunk_size;
+  uintptr_t end  = (uintptr_t)arena->linked_list + arena->arena_size;
+
+  bin_remove(arena, p);
+  arena->arena_size -= release;
+  STAT_ADD(arena->committed, -release);
+  node_set_size(arena, p, size - release);
+  bin_insert(arena, p);
+
+  memory_decommit(end - release, end, arena->arena_end);
+}
+
+
+/*...........................................................................*/
+/*..                          LARGE BLOCKS                                 ..*/
+/*...........................................................................*/
+
+// big allocations get a mapping of their own instead of being split
+// from an arena. The OS gives us the memory zeroed, and only
+// touches pages when they are used.
+
+#define DEFAULT_MMAP_THRESHOLD (256 << 10)
+
+
+// the memory in front of a mapped node's memory, enough for its header
+static size_t mapped_front(size_t alignment)
+{
+  return (sizeof(struct node_t) + alignment - 1) & ~(alignment - 1);
+}
+
+
+/**
+*
+* Maps a node of its own for a large allocation
+*
+* @param bytes : Bytes of memory needed, already rounded
+* @param alignment : What the memory has to be aligned to
+* @param huge : Whether to put it in huge pages
+*
+* @return Pointer to the allocated node, or NULL if it can't be mapped.
+*
+*/
+static struct node_t* node_map(size_t bytes, size_t alignment, int huge)
+{
+  size_t page = page_size();
+
+  if (alignment < MEMORY_ALIGNMENT)
+    alignment = MEMORY_ALIGNMENT;
+
+  // the mapping is only page aligned
+  size_t front = mapped_front(alignment);
+  if (front > page || bytes > SIZE_MAX - front - page)
+    return NULL;
+
+  size_t length = (front + bytes + page - 1) & ~(page - 1);
+
+  // only worth it if it fills a huge page, and then it
+  // has to start on one, so map extra and trim it
+  huge = huge && length >= HUGE_PAGE_SIZE && length <= SIZE_MAX - HUGE_PAGE_SIZE;
+  size_t extra = huge ? HUGE_PAGE_SIZE : 0;
+
+  uint8_t* memory = mmap(NULL, length + extra, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+    return NULL;
+
+  if (huge)
+  {
+    uint8_t* aligned = (uint8_t*)(((uintptr_t)memory + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+
+    if (aligned != memory)
+      munmap(memory, aligned - memory);
+    if (aligned + length != memory + length + extra)
+      munmap(aligned + length, memory + extra - aligned);
+
+    memory = aligned;
+    memory_advise_huge((uintptr_t)memory, (uintptr_t)memory + length);
+  }
+
+  return create_mapped_node(memory + front - sizeof(struct node_t),
+                            length - front + sizeof(struct node_t));
+}
+
+
+// the mapping a mapped node is in starts on the same page as its header
+static uintptr_t mapping_start(struct node_t* p)
+{
+  return (uintptr_t)p & ~(page_size() - 1);
+}
+
+
+// unmaps a mapped node
+static void node_unmap(struct node_t* p)
+{
+  uintptr_t start = mapping_start(p);
+  munmap((void*)start, (uintptr_t)p->memory + node_size(p) - start);
+}
+
+
+/**
+*
+* Shrinks a mapped node, giving back the pages it no longer needs
+*
+* @param p : Pointer to the mapped node
+* @param bytes : The size to shrink it to
+*
+* @return How many bytes it shrank by.
+*
+*/
+static size_t node_unmap_tail(struct node_t* p, size_t bytes)
+{
+  size_t page = page_size();
+  uintptr_t end = (uintptr_t)p->memory + node_size(p);
+  uintptr_t keep = ((uintptr_t)p->memory + bytes + page - 1) & ~(page - 1);
+
+  if (keep >= end)
+    return 0;
+
+  munmap((void*)keep, end - keep);
+  create_mapped_node(p, keep - (uintptr_t)p);
+  return end - keep;
+}
+
+
+/*...........................................................................*/
+/*..                          NUMA                                         ..*/
+/*...........................................................................*/
+
+// with ARENA_BY_NODE every NUMA node gets arenas of its own and threads
+// allocate from the arenas on the node they're running on. Memory is
+// bound with the mbind system call rather than through libnuma, and if
+// that isn't there or fails the memory goes wherever the OS puts it.
+
+// mbind's policy and flags, as in <numaif.h>
+#define NUMA_PREFERRED 1
+#define NUMA_MOVE      2
+
+// the node the calling thread is on, found the first time it's needed
+// unless set_thread_node() was called, -1 until then
+static __thread int thread_node = -1;
+static __thread int thread_cpu;
+
+
+/**
+*
+* Counts the NUMA nodes the machine could have
+*
+* @return How many there are, 1 if it can't be found out.
+*
+*/
+static unsigned numa_node_count()
+{
+  FILE* file = fopen("/sys/devices/system/node/possible", "r");
+  if (file == NULL)
+    return 1;
+
+  // a list of ranges like "0-3" or "0,2-3", the highest is all we need
+  unsigned highest = 0;
+  unsigned n = 0;
+  int c;
+
+  while ((c = fgetc(file)) != EOF)
+  {
+    if (c >= '0' && c <= '9')
+    {
+      n = n * 10 + (unsigned)(c - '0');
+      continue;
+    }
+
+    if (n > highest)
+      highest = n;
+    n = 0;
+  }
+
+  fclose(file);
+
+  if (n > highest)
+    highest = n;
+
+  return highest < MAX_ARENAS ? highest + 1 : MAX_ARENAS;
+}
+
+
+/**
+*
+* Asks for the pages of some memory to come from a NUMA node, pages
+* already in use are moved there. Only whole pages can be, so anything
+* either side of them is left alone. Does nothing where mbind isn't
+* supported.
+*
+* @param from : Start of the memory
+* @param to : End of the memory
+* @param node : The node it should be on
+*
+*/
+static void memory_bind_node(uintptr_t from, uintptr_t to, unsigned node)
+{
+#ifdef SYS_mbind
+  size_t page = page_size();
+  uintptr_t start = (from + page - 1) & ~(page - 1);
+  uintptr_t end   = to & ~(page - 1);
+  unsigned long mask = 1UL << node;
+
+  assert(node < sizeof(mask) * 8);
+  if (end > start)
+    syscall(SYS_mbind, start, end - start, NUMA_PREFERRED, &mask, sizeof(mask) * 8, NUMA_MOVE);
+#else
+  (void)from;
+  (void)to;
+  (void)node;
+#endif
+}
+
+
+/**
+*
+* Finds the NUMA node the calling thread is on
+*
+* @param heap : The heap it's allocating from
+*
+* @return The node, less than heap->numa_nodes.
+*
+*/
+static unsigned current_node(struct heap_t* heap)
+{
+  // threads aren't often moved between nodes, so this is only asked once
+  if (thread_node < 0)
+  {
+    unsigned cpu = 0;
+    unsigned node = 0;
+#ifdef SYS_getcpu
+    syscall(SYS_getcpu, &cpu, &node, NULL);
+#endif
+    thread_cpu  = (int)cpu;
+    thread_node = (int)node;
+  }
+
+  // a simulated topology shares the cpus out between its nodes,
+  // unless the thread has said where it is
+  if (heap->numa_simulated && thread_cpu >= 0)
+    return (unsigned)thread_cpu % heap->numa_nodes;
+
+  return (unsigned)thread_node % heap->numa_nodes;
+}
+
+
+/*...........................................................................*/
+/*..                          WILDERNESS                                   ..*/
+/*...........................................................................*/
+
+// with a wilderness, an arena starts as one small free node and the
+// untouched memory after it. Nodes are carved off the untouched memory
+// with a compare-and-swap on wild_top, no lock and no search, until
+// something isn't found in the arena's nodes. Then the rest of it is
+// added to the arena and the heap's algorithm takes over.
+
+// the node an arena with a wilderness starts with
+#define WILD_FIRST_NODE \
+  ((sizeof(struct node_t) + MINIMUM_FREE_BLOCK + MEMORY_ALIGNMENT - 1) & ~(MEMORY_ALIGNMENT - 1))
+
+
+/**
+*
+* Carves an allocated node off an arena's wilderness without its lock
+*
+* @param arena : The arena
+* @param bytes : Bytes of memory to allocate, already rounded
+*
+* @return Pointer to the allocated node or NULL if there's no room.
+*
+*/
+static struct node_t* wild_allocate(struct arena_t* arena, size_t bytes)
+{
+  // there isn't one, or there's no more carving
+  if (atomic_load_explicit(&arena->wild_top, memory_order_relaxed) == 0)
+    return NULL;
+
+  // counted until the header is written, so wild_close can wait
+  atomic_fetch_add(&arena->wild_carving, 1);
+
+  uintptr_t top = atomic_load(&arena->wild_top);
+  do
+  {
+    if (top == 0 || bytes > arena->wild_end - top ||
+        arena->wild_end - top - bytes < sizeof(struct node_t))
+    {
+      atomic_fetch_sub(&arena->wild_carving, 1);
+      return NULL;
+    }
+  } while (!atomic_compare_exchange_weak(&arena->wild_top, &top,
+             top + sizeof(struct node_t) + bytes));
+
+  struct node_t* p = create_used_node((void*)top, sizeof(struct node_t) + bytes);
+  atomic_fetch_sub(&arena->wild_carving, 1);
+  return p;
+}
+
+
+/**
+*
+* Stops nodes being carved and links the ones that have been into
+* the arena. Must be called with the arena's lock held.
+*
+* @param arena : The arena
+*
+* @return Where the next node would have been carved, or 0 if
+*         there's no more carving.
+*
+*/
+static uintptr_t wild_close(struct arena_t* arena)
+{
+  uintptr_t top = atomic_exchange(&arena->wild_top, 0);
+
+  // a node may have been carved and not have its header yet
+  while (atomic_load(&arena->wild_carving))
+    sched_yield();
+
+  for (uintptr_t p = arena->wild_base; p < top; )
+  {
+    struct node_t* node = (struct node_t*)p;
+    size_t size = sizeof(struct node_t) + node_size(node);
+
+    node_append(arena, node);
+    STAT_ADD(arena->node_count, 1);
+    STAT_ADD(arena->committed, size);
+    p += size;
+  }
+
+  if (top)
+    arena->wild_base = top;
+  return top;
+}
+
+
+/**
+*
+* Links any nodes carved off an arena's wilderness into the arena,
+* they can't be freed or coalesced with until they are.
+* Must be called with the arena's lock held.
+*
+* @param arena : The arena
+*
+*/
+static void wild_seal(struct arena_t* arena)
+{
+  uintptr_t top = atomic_load_explicit(&arena->wild_top, memory_order_relaxed);
+
+  // nothing carved since last time, or no more carving
+  if (top == arena->wild_base || top == 0)
+    return;
+
+  atomic_store(&arena->wild_top, wild_close(arena));
+}
+
+
+/**
+*
+* Adds whatever is left of an arena's wilderness to the arena.
+* Must be called with the arena's lock held.
+*
+* @param arena : The arena
+*
+* @return Whether the arena got any more free memory.
+*
+*/
+static int wild_release(struct arena_t* arena)
+{
+  if (arena->wild_base == arena->wild_end)
+    return 0;
+
+  uintptr_t top = wild_close(arena);
+  arena->wild_base = arena->wild_end;
+
+  if (top == arena->wild_end)
+    return 0;
+
+  arena_extend(arena, arena->wild_end - top);
+  return 1;
+}
+
+
+// bytes of an arena's wilderness left, read without the lock
+static size_t wild_left(struct arena_t* arena)
+{
+  uintptr_t top = atomic_load_explicit(&arena->wild_top, memory_order_relaxed);
+  return top ? arena->wild_end - top : 0;
+}
+
+
+/*...........................................................................*/
+/*..                          ARENA LOCKS                                  ..*/
+/*...........................................................................*/
+
+// arena locks are held for a split or a merge, so the other policies
+// spin rather than sleep. They spin this many times, then give up the
+// CPU between tries so a thread that was preempted holding the lock,
+// or ahead of us in the queue, can run.
+#define LOCK_SPINS 128
+
+// a thread queues on a node of its own for each MCS lock it takes,
+// and may hold more than one lock at once
+#define MCS_NODES 4
+static __thread struct mcs_node_t mcs_nodes[MCS_NODES];
+
+#ifdef _DEBUG
+// how many arena locks the thread holds, nothing that locks
+// another heap's arenas may run while it holds any
+static __thread unsigned arenas_locked;
+#endif
+
+
+// finds one of the thread's MCS nodes that isn't queued on a lock
+static struct mcs_node_t* mcs_take()
+{
+  unsigned i = 0;
+  while (i < MCS_NODES && mcs_nodes[i].in_use)
+    i++;
+
+  // more locks held at once than there are nodes
+  assert(i < MCS_NODES);
+  mcs_nodes[i].in_use = 1;
+  return &mcs_nodes[i];
+}
+
+
+// waits a moment before checking a lock again
+static void lock_pause(unsigned* spins)
+{
+  if (++*spins < LOCK_SPINS)
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+  }
+  else
+    sched_yield();
+}
+
+
+/**
+*
+* Takes an arena's lock if nobody has it
+*
+* @param arena : The arena
+*
+* @return Whether it was taken.
+*
+*/
+static int lock_try(struct arena_t* arena)
+{
+  switch (arena->lock_policy)
+  {
+    case LOCK_TICKET:
+    {
+      // only if our ticket would be served straight away
+      unsigned serving = atomic_load_explicit(&arena->ticket_serving, memory_order_acquire);
+      unsigned ticket  = serving;
+      return atomic_compare_exchange_strong_explicit(&arena->ticket_next, &ticket, serving + 1,
+               memory_order_acquire, memory_order_relaxed);
+    }
+
+    case LOCK_MCS:
+    {
+      struct mcs_node_t* node = mcs_take();
+      struct mcs_node_t* tail = NULL;
+      atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+
+      if (!atomic_compare_exchange_strong_explicit(&arena->mcs_tail, &tail, node,
+             memory_order_acquire, memory_order_relaxed))
+      {
+        node->in_use = 0;
+        return 0;
+      }
+
+      arena->mcs_holder = node;
+      return 1;
+    }
+
+    default:
+      return pthread_mutex_trylock(&arena->lock) == 0;
+  }
+}
+
+
+/**
+*
+* Takes an arena's lock, waiting for it as long as it takes
+*
+* @param arena : The arena
+*
+*/
+static void lock_wait(struct arena_t* arena)
+{
+  unsigned spins = 0;
+
+  switch (arena->lock_policy)
+  {
+    case LOCK_ADAPTIVE:
+      // whoever has it will probably let go soon, if not sleep
+      while (spins < LOCK_SPINS)
+      {
+        if (pthread_mutex_trylock(&arena->lock) == 0)
+          return;
+        lock_pause(&spins);
+      }
+      pthread_mutex_lock(&arena->lock);
+      return;
+
+    case LOCK_TICKET:
+    {
+      // threads are served in the order they arrive
+      unsigned ticket = atomic_fetch_add_explicit(&arena->ticket_next, 1, memory_order_relaxed);
+      while (atomic_load_explicit(&arena->ticket_serving, memory_order_acquire) != ticket)
+        lock_pause(&spins);
+      return;
+    }
+
+    case LOCK_MCS:
+    {
+      struct mcs_node_t* node = mcs_take();
+      atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+      atomic_store_explicit(&node->waiting, 1, memory_order_relaxed);
+
+      // join the end of the queue, and wait for the thread
+      // in front of us to hand the lock over
+      struct mcs_node_t* prev = atomic_exchange_explicit(&arena->mcs_tail, node,
+                                                         memory_order_acq_rel);
+      if (prev)
+      {
+        atomic_store_explicit(&prev->next, node, memory_order_release);
+        while (atomic_load_explicit(&node->waiting, memory_order_acquire))
+          lock_pause(&spins);
+      }
+
+      arena->mcs_holder = node;
+      return;
+    }
+
+    default:
+      pthread_mutex_lock(&arena->lock);
+      return;
+  }
+}
+
+
+/**
+*
+* Lets go of an arena's lock
+*
+* @param arena : The arena
+*
+*/
+static void lock_release(struct arena_t* arena)
+{
+  switch (arena->lock_policy)
+  {
+    case LOCK_TICKET:
+    {
+      // only the holder changes it
+      unsigned serving = atomic_load_explicit(&arena->ticket_serving, memory_order_relaxed);
+      atomic_store_explicit(&arena->ticket_serving, serving + 1, memory_order_release);
+      return;
+    }
+
+    case LOCK_MCS:
+    {
+      struct mcs_node_t* node = arena->mcs_holder;
+      struct mcs_node_t* next = atomic_load_explicit(&node->next, memory_order_acquire);
+      arena->mcs_holder = NULL;
+
+      if (next == NULL)
+      {
+        // nobody waiting, the queue is empty again
+        struct mcs_node_t* tail = node;
+        if (atomic_compare_exchange_strong_explicit(&arena->mcs_tail, &tail, NULL,
+              memory_order_release, memory_order_relaxed))
+        {
+          node->in_use = 0;
+          return;
+        }
+
+        // somebody is joining, wait until they're behind us
+        unsigned spins = 0;
+        while ((next = atomic_load_explicit(&node->next, memory_order_acquire)) == NULL)
+          lock_pause(&spins);
+      }
+
+      atomic_store_explicit(&next->waiting, 0, memory_order_release);
+      node->in_use = 0;
+      return;
+    }
+
+    default:
+      pthread_mutex_unlock(&arena->lock);
+      return;
+  }
+}
+
+
+/**
+*
+* Sets up an arena's lock
+*
+* @param arena : The arena
+* @param policy : What kind of lock, one of the LOCK_ macros
+*
+*/
+static void lock_init(struct arena_t* arena, unsigned policy)
+{
+  arena->lock_policy = policy;
+  atomic_init(&arena->ticket_next, 0);
+  atomic_init(&arena->ticket_serving, 0);
+  atomic_init(&arena->mcs_tail, NULL);
+  arena->mcs_holder = NULL;
+  pthread_mutex_init(&arena->lock, NULL);
+}
+
+
+/*...........................................................................*/
+/*..                          ARENAS                                       ..*/
+/*...........................................................................*/
+
+// threads are given an arena when they first allocate, threads
+// are numbered in the order they do that
+static atomic_uint thread_count;
+static __thread unsigned thread_number;
+
+// arenas set up so far, for making their pending keys
+static _Atomic uint64_t pending_keys;
+
+
+/**
+*
+* Sets up an arena over a block of memory, creates the first memory
+* node and adds it to the arena's linked list.
+*
+* @param arena : The arena to set up
+* @param memory : Pointer to a block of memory for the nodes.
+* @param size : The size of the memory in bytes.
+* @param heap : The heap it's for, its algorithm decides how the
+*               free nodes are kept
+*
+*/
+static void arena_init(struct arena_t* arena, void* memory, size_t size, struct heap_t* heap)
+{
+  // a fixed amount of memory, heap_init changes this for mapped heaps
+  arena->arena_end   = (uintptr_t)memory + size;
+  arena->chunk_size  = 0;
+  arena->spare_bytes = 0;
+
+#ifdef COMPACT_HEADERS
+  // the first header goes just before an aligned address so its memory
+  // is aligned, and the arena ends where a node would start
+  size_t skip = (MEMORY_ALIGNMENT + sizeof(struct node_t) -
+                 (uintptr_t)memory % MEMORY_ALIGNMENT) % MEMORY_ALIGNMENT;
+  memory = (uint8_t*)memory + skip;
+  size   = (size - skip) & ~(MEMORY_ALIGNMENT - 1);
+#endif
+
+  int buddy = heap->find_node == find_buddy;
+
+  if (buddy)
+  {
+    // line the memory of the first block up on BUDDY_ALIGNMENT, and
+    // use whole blocks, that keeps the memory of every block aligned
+    size_t lining = (BUDDY_ALIGNMENT - ((uintptr_t)memory + sizeof(struct node_t)) %
+                     BUDDY_ALIGNMENT) % BUDDY_ALIGNMENT;
+    assert(size > lining + BUDDY_MIN_BLOCK);
+    memory = (uint8_t*)memory + lining;
+    size   = (size - lining) & ~(size_t)(BUDDY_MIN_BLOCK - 1);
+  }
+
+  // with a wilderness, the first node is as small as it can be and
+  // the rest of the memory is carved from
+  size_t first = heap->wilderness ? WILD_FIRST_NODE : size;
+  assert(first <= size);
+
+  arena->wild_base = (uintptr_t)memory + first;
+  arena->wild_end  = (uintptr_t)memory + size;
+  atomic_init(&arena->wild_top, first < size ? arena->wild_base : 0);
+  atomic_init(&arena->wild_carving, 0);
+
+  // create a node containg all of free memory and point our list at it
+  struct node_t* p = create_node(memory, first);
+
+  arena->arena_size  = first;
+
+  // change head of linked list to point to this node
+  arena->linked_list = p;
+  arena->last_node   = p;
+
+  // we dont have a next/last-used node yet
+  arena->next_node   = NULL;
+
+  // start the statistics from nothing
+  atomic_init(&arena->node_count, 1);
+  atomic_init(&arena->committed, first);
+  atomic_init(&arena->free_bytes, 0);
+  atomic_init(&arena->free_blocks, 0);
+  atomic_init(&arena->largest_free, 0);
+  arena->largest_stale = 0;
+  atomic_init(&arena->lock_waits, 0);
+  atomic_init(&arena->lock_wait_ns, 0);
+  atomic_init(&arena->allocations, 0);
+  atomic_init(&arena->deallocations, 0);
+  atomic_init(&arena->failed_allocations, 0);
+  atomic_init(&arena->pending_frees, NULL);
+  arena->pending_key = (struct node_t*)(uintptr_t)
+    ((atomic_fetch_add(&pending_keys, 1) + 1) * 0x9E3779B97F4A7C15ULL | 1);
+
+  // empty the bins and add our one free node
+  memset(arena->bins, 0, sizeof(arena->bins));
+  memset(arena->bin_map, 0, sizeof(arena->bin_map));
+  arena->size_tree = NULL;
+  arena->sorted    = heap->find_node == find_best_fit || heap->find_node == find_worst_fit;
+  arena->buddy     = buddy;
+  arena->deferred  = heap->deferred_frees;
+  bin_insert(arena, p);
+
+  if (buddy)
+    buddy_tile(arena);
+
+  lock_init(arena, heap->lock_policy);
+}
+
+
+/**
+*
+* Hands a block to its arena without taking the arena's lock. Threads
+* freeing blocks from an arena they don't use would otherwise contend
+* with the threads that do, so the block is pushed onto the arena's
+* pending free list and released next time the arena is locked.
+* With deferred frees every free comes here, and it is all they cost.
+*
+* @param arena : The arena the block belongs to
+* @param p : Pointer to the allocated node
+*
+*/
+static void free_later(struct arena_t* arena, struct node_t* p)
+{
+  FREE_LINKS(p)->prev_free = arena->pending_key;
+  struct node_t* head = atomic_load_explicit(&arena->pending_frees, memory_order_relaxed);
+
+  do
+  {
+    FREE_LINKS(p)->next_free = head;
+  } while (!atomic_compare_exchange_weak_explicit(&arena->pending_frees, &head, p,
+             memory_order_release, memory_order_relaxed));
+}
+
+
+/**
+*
+* Says whether a block that isn't free is waiting on its arena's
+* pending free list, which means it has already been freed
+*
+* @param arena : The arena the block belongs to
+* @param p : Pointer to the node
+*
+* @return Whether it is pending.
+*
+*/
+static int node_is_pending(struct arena_t* arena, struct node_t* p)
+{
+  return FREE_LINKS(p)->prev_free == arena->pending_key;
+}
+
+
+/**
+*
+* Sorts a list of nodes linked through next_free by address
+*
+* @param list : The first node
+*
+* @return The first node of the sorted list.
+*
+*/
+static struct node_t* sort_by_address(struct node_t* list)
+{
+  if (list == NULL || FREE_LINKS(list)->next_free == NULL)
+    return list;
+
+  // split it in half
+  struct node_t* middle = list;
+  struct node_t* end = FREE_LINKS(list)->next_free;
+  while (end && FREE_LINKS(end)->next_free)
+  {
+    middle = FREE_LINKS(middle)->next_free;
+    end = FREE_LINKS(FREE_LINKS(end)->next_free)->next_free;
+  }
+
+  struct node_t* a = list;
+  struct node_t* b = FREE_LINKS(middle)->next_free;
+  FREE_LINKS(middle)->next_free = NULL;
+
+  a = sort_by_address(a);
+  b = sort_by_address(b);
+
+  // and merge the sorted halves
+  struct node_t* head = NULL;
+  struct node_t** tail = &head;
+  while (a && b)
+  {
+    struct node_t** first = a < b ? &a : &b;
+    *tail = *first;
+    *first = FREE_LINKS(*first)->next_free;
+    tail = &FREE_LINKS(*tail)->next_free;
+  }
+  *tail = a ? a : b;
+  return head;
+}
+
+
+/**
+*
+* Releases every block waiting on an arena's pending free list. They
+* are released in address order, and runs of blocks next to each other
+* are joined first so they are coalesced and binned once.
+* Must be called with the arena's lock held.
+*
+* @param arena : The arena
+*
+*/
+static void drain_pending(struct arena_t* arena)
+{
+  // only ever taken all at once, so there's no ABA problem
+  if (atomic_load_explicit(&arena->pending_frees, memory_order_relaxed) == NULL)
+    return;
+
+  struct node_t* p = atomic_exchange_explicit(&arena->pending_frees, NULL, memory_order_acquire);
+  p = sort_by_address(p);
+
+  // they may have been carved since the arena was locked
+  wild_seal(arena);
+
+  while (p)
+  {
+    struct node_t* next = FREE_LINKS(p)->next_free;
+
+    // the mark would stay in the memory of a block joined to the one
+    // before it, and look like a pending block once it's allocated
+    FREE_LINKS(p)->prev_free = NULL;
+
+    // buddy blocks can only be joined with their buddies
+    while (!arena->buddy && next && next == node_next(arena, p))
+    {
+      struct node_t* after = FREE_LINKS(next)->next_free;
+      FREE_LINKS(next)->prev_free = NULL;
+
+      // its header is left behind in p, marked free so
+      // freeing it again is caught like any other block
+      node_set_free(arena, next, 1);
+
+      if (arena->next_node == next)
+        arena->next_node = p;
+
+      node_join_next(arena, p);
+      STAT_ADD(arena->node_count, -1);
+      next = after;
+    }
+
+    release_node(arena, p);
+    p = next;
+  }
+
+  // the caller may look at it before the lock is released
+  if (arena->largest_stale)
+  {
+    atomic_store_explicit(&arena->largest_free, bin_largest(arena), memory_order_relaxed);
+    arena->largest_stale = 0;
+  }
+}
+
+
+/**
+*
+* Locks an arena, timing how long we wait if another thread has it,
+* links in any nodes carved from its wilderness, and then releases
+* anything freed to it by other threads, unless frees are deferred
+*
+* @param arena : The arena to lock
+*
+*/
+static void arena_lock(struct arena_t* arena)
+{
+#ifdef _DEBUG
+  arenas_locked++;
+#endif
+
+  if (lock_try(arena))
+  {
+#ifdef MM_INSTRUMENT
+    INSTRUMENT(INSTRUMENT_LOCK_WAIT, 0);
+    lock_acquired = now_ns();
+#endif
+    wild_seal(arena);
+    if (!arena->deferred)
+      drain_pending(arena);
+    return;
+  }
+
+  uint64_t start = now_ns();
+  lock_wait(arena);
+  uint64_t waited = now_ns() - start;
+
+  STAT_ADD(arena->lock_waits, 1);
+  STAT_ADD(arena->lock_wait_ns, waited);
+
+#ifdef MM_INSTRUMENT
+  INSTRUMENT(INSTRUMENT_LOCK_WAIT, waited);
+  lock_acquired = now_ns();
+#endif
+  wild_seal(arena);
+  if (!arena->deferred)
+    drain_pending(arena);
+}
+
+
+/**
+*
+* Unlocks an arena, first giving back any memory a mapped arena
+* doesn't need and bringing its biggest free node up to date
+*
+* @param arena : The arena to unlock
+*
+*/
+static void arena_unlock(struct arena_t* arena)
+{
+  if (arena->chunk_size)
+    arena_trim(arena);
+
+  if (arena->largest_stale)
+  {
+    atomic_store_explicit(&arena->largest_free, bin_largest(arena), memory_order_relaxed);
+    arena->largest_stale = 0;
+  }
+
+  INSTRUMENT(INSTRUMENT_LOCK_HOLD, now_ns() - lock_acquired);
+  lock_release(arena);
+
+#ifdef _DEBUG
+  arenas_locked--;
+#endif
+}
+
+
+/**
+*
+* Finds the arena the calling thread should allocate from
+*
+* @param heap : The heap to allocate from
+*
+* @return Index of the arena.
+*
+*/
+static unsigned home_arena(struct heap_t* heap)
+{
+  if (heap->arena_count == 1)
+    return 0;
+
+  if (heap->arena_policy == ARENA_BY_CPU)
+  {
+    int cpu = sched_getcpu();
+    if (cpu >= 0)
+      return (unsigned)cpu % heap->arena_count;
+  }
+
+  // threads are numbered in the order they first allocated
+  if (thread_number == 0)
+    thread_number = atomic_fetch_add(&thread_count, 1) + 1;
+
+  // round robin between the arenas on the thread's node
+  if (heap->arena_policy == ARENA_BY_NODE)
+  {
+    unsigned node  = current_node(heap);
+    unsigned nodes = heap->numa_nodes;
+    unsigned count = (heap->arena_count - node + nodes - 1) / nodes;
+
+    return node + nodes * ((thread_number - 1) % count);
+  }
+
+  // round robin
+  return (thread_number - 1) % heap->arena_count;
+}
+
+
+/**
+*
+* Finds the arena a node is in from its address
+*
+* @param heap : The heap the node belongs to
+* @param p : Pointer to the node
+*
+* @return Pointer to the arena.
+*
+*/
+static struct arena_t* arena_of(struct heap_t* heap, struct node_t* p)
+{
+  size_t i = ((uintptr_t)p - heap->arena_base) / heap->arena_span;
+
+  // the last arena has any memory left over from the split
+  if (i >= heap->arena_count)
+    i = heap->arena_count - 1;
+
+  return &heap->arenas[i];
+}
+
+
+/*...........................................................................*/
+/*..                          RECLAIMER                                    ..*/
+/*...........................................................................*/
+
+
+// drains every arena's pending frees until told to stop
+static void* reclaimer(void* arg)
+{
+  struct heap_t* heap = arg;
+
+  pthread_mutex_lock(&heap->reclaim_lock);
+
+  while (!heap->reclaim_stop)
+  {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += RECLAIM_INTERVAL_NS;
+    if (until.tv_nsec >= 1000000000L)
+    {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+    }
+
+    pthread_cond_timedwait(&heap->reclaim_wake, &heap->reclaim_lock, &until);
+    if (heap->reclaim_stop)
+      break;
+
+    pthread_mutex_unlock(&heap->reclaim_lock);
+
+    for (unsigned i = 0; i < heap->arena_count; i++)
+    {
+      struct arena_t* arena = &heap->arenas[i];
+
+      if (atomic_load_explicit(&arena->pending_frees, memory_order_relaxed))
+      {
+        arena_lock(arena);
+        drain_pending(arena);
+        arena_unlock(arena);
+      }
+    }
+
+    pthread_mutex_lock(&heap->reclaim_lock);
+  }
+
+  pthread_mutex_unlock(&heap->reclaim_lock);
+  return NULL;
+}
+
+
+/**
+*
+* Starts a heap's reclaimer thread
+*
+* @param heap : The heap
+*
+*/
+static void reclaim_start(struct heap_t* heap)
+{
+  pthread_mutex_init(&heap->reclaim_lock, NULL);
+  pthread_cond_init(&heap->reclaim_wake, NULL);
+  heap->reclaim_stop = 0;
+
+  if (pthread_create(&heap->reclaimer, NULL, reclaimer, heap))
+  {
+    fprintf(stderr, "Error : cannot start reclaimer thread\n");
+    exit(EXIT_FAILURE);
+  }
+
+  heap->reclaiming = 1;
+}
+
+
+/**
+*
+* Stops a heap's reclaimer thread, if it has one. Anything still
+* pending is left, the heap is going or being initialised again.
+*
+* @param heap : The heap
+*
+*/
+static void reclaim_stop(struct heap_t* heap)
+{
+  if (!heap->reclaiming)
+    return;
+
+  pthread_mutex_lock(&heap->reclaim_lock);
+  heap->reclaim_stop = 1;
+  pthread_cond_signal(&heap->reclaim_wake);
+  pthread_mutex_unlock(&heap->reclaim_lock);
+
+  pthread_join(heap->reclaimer, NULL);
+  pthread_cond_destroy(&heap->reclaim_wake);
+  pthread_mutex_destroy(&heap->reclaim_lock);
+  heap->reclaiming = 0;
+}
+
+
+/*...........................................................................*/
+/*..                          THREAD CACHE                                 ..*/
+/*...........................................................................*/
+
+// small blocks freed by a thread are kept in a cache for that thread,
+// so they can be handed out again without taking the lock. Cached
+// blocks still look allocated to the rest of the heap.
+
+// blocks up to this size are cached
+#define TCACHE_MAX_SIZE 512
+#define TCACHE_CLASSES  (TCACHE_MAX_SIZE / MEMORY_ALIGNMENT)
+
+// most blocks a thread keeps per size class, and how many are moved
+// to or from the heap in one go when a class is full or empty
+#define TCACHE_COUNT 16
+#define TCACHE_BATCH 8
+
+// how many heaps a thread keeps caches for at once
+#define TCACHE_HEAPS 4
+
+// a thread's cache for one heap
+struct tcache_t
+{
+  struct heap_t* heap;
+  unsigned long  generation;
+  struct node_t* blocks[TCACHE_CLASSES];
+  unsigned       count[TCACHE_CLASSES];
+};
+
+// all of a thread's caches
+struct thread_caches_t
+{
+  unsigned        registered;
+  unsigned        victim;
+  struct tcache_t caches[TCACHE_HEAPS];
+};
+
+static __thread struct thread_caches_t thread_caches;
+
+// used to flush a thread's caches when it exits
+static pthread_key_t  tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+// cached blocks have this in their prev_free link, so we can spot
+// a block being freed twice without searching on every deallocate
+#define TCACHE_KEY ((struct node_t*)&tcache_key)
+
+
+/**
+*
+* Checks if a heap is still alive. Must be called with heaps_lock held.
+*
+* @param heap : The heap to look for
+* @param generation : The generation the heap should have
+*
+* @return Whether the heap exists.
+*
+*/
+static int heap_is_live(struct heap_t* heap, unsigned long generation)
+{
+  for (struct heap_t* h = heaps; h; h = h->next_heap)
+  {
+    if (h == heap)
+      return h->generation == generation;
+  }
+  return 0;
+}
+
+
+/**
+*
+* Finds the cache class for a block of a given size. Every block in a
+* class is at least as big as the class size.
+*
+* @param size : The size of the block
+*
+* @return Index of the class.
+*
+*/
+static unsigned tcache_class(size_t size)
+{
+  return size / MEMORY_ALIGNMENT - 1;
+}
+
+
+/**
+*
+* Returns some of a thread's cached blocks to the heap.
+* Blocks can be from any arena, but we only take an
+* arena's lock again when the arena changes. Blocks from
+* arenas other threads use, or any blocks if frees are
+* deferred, go on their arena's pending free list.
+*
+* @param cache : The thread's cache
+* @param c : The class to flush
+* @param count : How many blocks to flush
+*
+*/
+static void tcache_flush(struct tcache_t* cache, unsigned c, unsigned count)
+{
+  struct heap_t* heap = cache->heap;
+  struct arena_t* home = &heap->arenas[home_arena(heap)];
+  struct arena_t* locked = NULL;
+
+  while (count-- && cache->blocks[c])
+  {
+    struct node_t* p = cache->blocks[c];
+    struct arena_t* arena = arena_of(heap, p);
+
+    if (arena != home || heap->deferred_frees)
+    {
+      cache->blocks[c] = FREE_LINKS(p)->next_free;
+      cache->count[c]--;
+      free_later(arena, p);
+      continue;
+    }
+
+    if (arena != locked)
+    {
+      if (locked)
+        arena_unlock(locked);
+      arena_lock(arena);
+      locked = arena;
+    }
+
+    cache->blocks[c] = FREE_LINKS(p)->next_free;
+    cache->count[c]--;
+    release_node(arena, p);
+  }
+
+  if (locked)
+    arena_unlock(locked);
+}
+
+
+/**
+*
+* Returns all of a thread's cached blocks to the heap
+*
+* @param cache : The thread's cache
+*
+* @return Whether there was anything to flush.
+*
+*/
+static int tcache_flush_all(struct tcache_t* cache)
+{
+  int flushed = 0;
+
+  for (unsigned c = 0; c < TCACHE_CLASSES; c++)
+  {
+    if (cache->count[c])
+    {
+      tcache_flush(cache, c, cache->count[c]);
+      flushed = 1;
+    }
+  }
+  return flushed;
+}
+
+
+/**
+*
+* Flushes a cache if its heap still exists and then empties it,
+* so it can be used for another heap
+*
+* @param cache : The thread's cache
+*
+*/
+static void tcache_retire(struct tcache_t* cache)
+{
+#ifdef _DEBUG
+  // flushing takes heaps_lock and then arena locks, so holding an
+  // arena lock here would nest them the wrong way round
+  assert(arenas_locked == 0);
+#endif
+
+  if (cache->heap)
+  {
+    pthread_mutex_lock(&heaps_lock);
+    if (heap_is_live(cache->heap, cache->generation))
+      tcache_flush_all(cache);
+    pthread_mutex_unlock(&heaps_lock);
+  }
+
+  memset(cache, 0, sizeof(struct tcache_t));
+}
+
+
+// flushes a thread's caches when it exits
+static void tcache_destroy(void* caches)
+{
+  struct thread_caches_t* t = caches;
+
+  for (unsigned i = 0; i < TCACHE_HEAPS; i++)
+    tcache_retire(&t->caches[i]);
+}
+
+
+static void tcache_create_key()
+{
+  pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+
+/**
+*
+* Finds the calling thread's cache for a heap, setting one up if
+* it doesn't have one
+*
+* @param heap : The heap
+*
+* @return Pointer to the cache.
+*
+*/
+static struct tcache_t* tcache_get(struct heap_t* heap)
+{
+  struct thread_caches_t* t = &thread_caches;
+  struct tcache_t* cache = NULL;
+
+  for (unsigned i = 0; i < TCACHE_HEAPS; i++)
+  {
+    if (t->caches[i].heap == heap)
+    {
+      cache = &t->caches[i];
+
+      // if the heap's been initialised again the blocks
+      // belong to the old one, so just forget them
+      if (cache->generation != heap->generation)
+        memset(cache, 0, sizeof(struct tcache_t));
+      break;
+    }
+  }
+
+  if (cache == NULL)
+  {
+    // use an unused cache, or make room by flushing one
+    for (unsigned i = 0; i < TCACHE_HEAPS && cache == NULL; i++)
+    {
+      if (t->caches[i].heap == NULL)
+        cache = &t->caches[i];
+    }
+
+    if (cache == NULL)
+    {
+      cache = &t->caches[t->victim++ % TCACHE_HEAPS];
+      tcache_retire(cache);
+    }
+  }
+
+  if (cache->heap == NULL)
+  {
+    cache->heap = heap;
+    cache->generation = heap->generation;
+  }
+
+  // make sure it gets flushed when the thread exits
+  if (!t->registered)
+  {
+    pthread_once(&tcache_once, tcache_create_key);
+    pthread_setspecific(tcache_key, t);
+    t->registered = 1;
+  }
+
+  return cache;
+}
+
+
+/**
+*
+* Takes a block from the calling thread's cache
+*
+* @param heap : The heap to allocate from
+* @param bytes : Bytes of memory needed, already rounded
+*
+* @return Pointer to an allocated node or NULL if the cache was empty.
+*
+*/
+static struct node_t* tcache_pop(struct heap_t* heap, size_t bytes)
+{
+  struct tcache_t* cache = tcache_get(heap);
+  unsigned c = tcache_class(bytes);
+
+  struct node_t* p = cache->blocks[c];
+  if (p)
+  {
+    cache->blocks[c] = FREE_LINKS(p)->next_free;
+    cache->count[c]--;
+    FREE_LINKS(p)->prev_free = NULL;
+  }
+  return p;
+}
+
+
+/**
+*
+* Fills the calling thread's cache for a size class.
+* Must be called with the arena's lock held, and the cache
+* got before it was taken, because getting one can flush
+* another heap's cache.
+*
+* @param cache : The thread's cache for the arena's heap
+* @param arena : The arena to allocate from
+* @param bytes : Size of the class, already rounded
+*
+*/
+static void tcache_fill(struct tcache_t* cache, struct arena_t* arena, size_t bytes)
+{
+  struct heap_t* heap = cache->heap;
+  unsigned c = tcache_class(bytes);
+
+  if (cache->count[c] >= TCACHE_BATCH)
+    return;
+
+  void* memory[TCACHE_BATCH];
+  size_t taken = take_nodes(heap, arena, TCACHE_BATCH - cache->count[c], bytes, memory);
+
+  for (size_t i = 0; i < taken; i++)
+  {
+    struct node_t* p = ((struct node_t*)memory[i]) - 1;
+
+    FREE_LINKS(p)->prev_free = TCACHE_KEY;
+    FREE_LINKS(p)->next_free = cache->blocks[c];
+    cache->blocks[c] = p;
+    cache->count[c]++;
+  }
+}
+
+
+/**
+*
+* Puts a block being freed into the calling thread's cache
+*
+* @param heap : The heap the block belongs to
+* @param p : Pointer to the allocated node
+* @param size : The node's size, or no more than it
+*
+* @return Whether the block was cached.
+*
+*/
+static int tcache_push(struct heap_t* heap, struct node_t* p, size_t size)
+{
+  if (size > TCACHE_MAX_SIZE)
+    return 0;
+
+  struct tcache_t* cache = tcache_get(heap);
+  unsigned c = tcache_class(size);
+
+  // it might already be in the cache, if so it's been freed twice
+  if (FREE_LINKS(p)->prev_free == TCACHE_KEY)
+  {
+    for (struct node_t* q = cache->blocks[c]; q; q = FREE_LINKS(q)->next_free)
+    {
+      if (q == p)
+      {
+        fprintf(stderr, "Error : memory already free\n");
+        return 1;
+      }
+    }
+  }
+
+  // make room by giving some back to the heap
+  if (cache->count[c] == TCACHE_COUNT)
+    tcache_flush(cache, c, TCACHE_BATCH);
+
+  FREE_LINKS(p)->prev_free = TCACHE_KEY;
+  FREE_LINKS(p)->next_free = cache->blocks[c];
+  cache->blocks[c] = p;
+  cache->count[c]++;
+  return 1;
+}
+
+
+/*...........................................................................*/
+/*..                          PUBLIC FUNCTIONS                             ..*/
+/*...........................................................................*/
+
+
+/**
+*
+* Sets up a heap over a block of memory, splitting it into arenas
+*
+* @param heap : The heap to set up
+* @param memory : Pointer to a block of memory for the arenas.
+* @param size : The size of the memory in bytes.
+* @param options : How the heap should be set up.
+* @param mapped : Whether the memory is reserved address space
+*                 that the arenas commit as they need it.
+*
+*/
+static void heap_init(struct heap_t* heap, void* memory, size_t size,
+                      const heap_options_t* options, int mapped)
+{
+  // memory cannot be NULL
+  // memor has to be of a minimum size
+  assert(memory);
+  assert(size > MINIMUM_HEAP_SIZE);
+
+  // the default heap may be being initialised again, its old
+  // reclaimer would be draining arenas that are going. Any other
+  // heap is new, whatever its memory held before.
+  if (heap == &default_heap)
+    reclaim_stop(heap);
+  heap->reclaiming = 0;
+
+  char* algorithm = options->algorithm;
+
+  // change find function pointer accordingly
+  if (!algorithm || strcmp(algorithm, FIRSTFIT) == 0)
+  {
+    heap->find_node = find_first_fit;
+  }
+  else if (strcmp(algorithm, NEXTFIT) == 0)
+  {
+    heap->find_node = find_next_fit;
+  }
+  else if (strcmp(algorithm, BESTFIT) == 0)
+  {
+    heap->find_node = find_best_fit;
+  }
+  else if (strcmp(algorithm, WORSTFIT) == 0)
+  {
+    heap->find_node = find_worst_fit;
+  } 
+  else if (strcmp(algorithm, SEGREGATEDFIT) == 0)
+  {
+    heap->find_node = find_segregated_fit;
+  }
+  else if (strcmp(algorithm, BUDDY) == 0)
+  {
+    heap->find_node = find_buddy;
+  }
+  else
+  {
+    fprintf(stderr, "Error : Unknown algorithm type\n");
+    exit(EXIT_FAILURE);
+  }
+
+  unsigned count = options->arenas ? options->arenas : 1;
+  unsigned nodes = numa_node_count();
+
+  heap->numa_nodes = 1;
+  heap->numa_simulated = 0;
+
+  // every node needs at least one arena
+  if (options->arena_policy == ARENA_BY_NODE)
+  {
+    heap->numa_nodes = options->numa_nodes ? options->numa_nodes : nodes;
+    assert(heap->numa_nodes <= MAX_ARENAS);
+    heap->numa_simulated = heap->numa_nodes != nodes;
+
+    if (count < heap->numa_nodes)
+      count = heap->numa_nodes;
+  }
+
+  assert(count <= MAX_ARENAS);
+
+  heap->arena_count  = count;
+  heap->arena_policy = options->arena_policy;
+
+  if (count == 1)
+  {
+    heap->arenas = &heap->first_arena;
+  }
+  else
+  {
+    // more than one arena, so they go at the start of the memory
+    uintptr_t base  = ((uintptr_t)memory + MEMORY_ALIGNMENT - 1) & ~(MEMORY_ALIGNMENT - 1);
+    uintptr_t start = base + count * sizeof(struct arena_t);
+    start = (start + MEMORY_ALIGNMENT - 1) & ~(MEMORY_ALIGNMENT - 1);
+
+    assert(size > start - (uintptr_t)memory);
+    if (mapped && !memory_commit(base, start))
+    {
+      fprintf(stderr, "Error : cannot commit memory for arenas\n");
+      exit(EXIT_FAILURE);
+    }
+
+    heap->arenas = (struct arena_t*)base;
+    size  -= start - (uintptr_t)memory;
+    memory = (void*)start;
+  }
+
+  // a mapped heap's arenas start on huge pages, it only costs address space
+  if (options->huge_pages && mapped)
+  {
+    uintptr_t start = ((uintptr_t)memory + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+    assert(size > start - (uintptr_t)memory);
+    size  -= start - (uintptr_t)memory;
+    memory = (void*)start;
+  }
+
+  // every arena gets the same amount of memory, except
+  // the last which also gets whatever is left over
+  heap->arena_base = (uintptr_t)memory;
+  heap->arena_span = (size / count) & ~(MEMORY_ALIGNMENT - 1);
+  if (options->huge_pages && mapped && heap->arena_span >= HUGE_PAGE_SIZE)
+    heap->arena_span &= ~(HUGE_PAGE_SIZE - 1);
+  heap->heap_size  = size;
+  heap->mapping    = NULL;
+  heap->mapping_size = 0;
+
+  heap->mmap_threshold = options->mmap_threshold ?
+    options->mmap_threshold : DEFAULT_MMAP_THRESHOLD;
+  heap->huge_pages = options->huge_pages != 0;
+  heap->deferred_frees = options->deferred_frees != 0;
+  heap->wilderness = options->wilderness && !mapped && heap->find_node != find_buddy;
+  heap->lock_policy = options->lock_policy;
+  assert(heap->lock_policy <= LOCK_MCS);
+  atomic_init(&heap->mapped_blocks, 0);
+  atomic_init(&heap->mapped_bytes, 0);
+  assert(heap->arena_span > MINIMUM_HEAP_SIZE);
+
+  // mapped arenas start with one chunk
+  size_t chunk = options->chunk_size ? options->chunk_size : DEFAULT_CHUNK_SIZE;
+  size_t spare = options->spare_chunks ? options->spare_chunks : DEFAULT_SPARE_CHUNKS;
+  chunk = (chunk + page_size() - 1) & ~(page_size() - 1);
+
+  // chunks are whole huge pages, so small blocks carved from
+  // them are packed into as few huge pages as possible
+  if (heap->huge_pages)
+  {
+    chunk = (chunk + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    memory_advise_huge((uintptr_t)memory, (uintptr_t)memory + size);
+  }
+
+  for (unsigned i = 0; i < count; i++)
+  {
+    uint8_t* start = (uint8_t*)memory + i * heap->arena_span;
+    size_t span = i == count - 1 ? size - i * heap->arena_span : heap->arena_span;
+
+    // before anything is written, so pages start on the right node.
+    // A simulated node may not be there at all.
+    unsigned node = i % heap->numa_nodes;
+    if (options->arena_policy == ARENA_BY_NODE && node < nodes)
+      memory_bind_node((uintptr_t)start, (uintptr_t)start + span, node);
+
+    if (!mapped)
+    {
+      arena_init(&heap->arenas[i], start, span, heap);
+      continue;
+    }
+
+    // buddy arenas can only have whole blocks, so they don't grow
+    // a chunk at a time. Pages are still only used once touched.
+    size_t commit = chunk < span && heap->find_node != find_buddy ? chunk : span;
+    if (!memory_commit((uintptr_t)start, (uintptr_t)start + commit))
+    {
+      fprintf(stderr, "Error : cannot commit memory for arenas\n");
+      exit(EXIT_FAILURE);
+    }
+
+    arena_init(&heap->arenas[i], start, commit, heap);
+    heap->arenas[i].arena_end   = (uintptr_t)start + span;
+    heap->arenas[i].chunk_size  = heap->find_node == find_buddy ? 0 : chunk;
+    heap->arenas[i].spare_bytes = spare * chunk;
+  }
+
+  pthread_mutex_lock(&heaps_lock);
+
+  // a new generation means anything cached by
+  // threads belongs to the old heap
+  static unsigned long generations;
+  heap->generation = ++generations;
+
+  // the heap may be being initialised again
+  struct heap_t* h = heaps;
+  while (h && h != heap)
+    h = h->next_heap;
+
+  if (h == NULL)
+  {
+    heap->next_heap = heaps;
+    heaps = heap;
+  }
+
+  pthread_mutex_unlock(&heaps_lock);
+
+  if (heap->deferred_frees)
+    reclaim_start(heap);
+}
+
+
+// creates a heap at the start of the memory it manages
+// full description in header file
+struct heap_t* heap_create_with(void* memory, size_t size, const heap_options_t* options)
+{
+  assert(memory);
+  assert(options);
+
+  // the heap goes first and the nodes after it, keep both aligned
+  uintptr_t base  = ((uintptr_t)memory + MEMORY_ALIGNMENT - 1) & ~(MEMORY_ALIGNMENT - 1);
+  uintptr_t start = base + sizeof(struct heap_t);
+  start = (start + MEMORY_ALIGNMENT - 1) & ~(MEMORY_ALIGNMENT - 1);
+
+  size_t used = start - (uintptr_t)memory;
+  assert(size > used + MINIMUM_HEAP_SIZE);
+
+  struct heap_t* heap = (struct heap_t*)base;
+  heap_init(heap, (void*)start, size - used, options, 0);
+  return heap;
+}
+
+
+/**
+*
+* Reserves address space for a mapped heap, none of it is usable
+* until it is committed
+*
+* @param size : How much to reserve, rounded up to whole pages
+*
+* @return Start of the reservation, or NULL if there isn't room.
+*
+*/
+static void* mapping_reserve(size_t* size)
+{
+  *size = (*size + page_size() - 1) & ~(page_size() - 1);
+
+  void* memory = mmap(NULL, *size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (memory == MAP_FAILED)
+  {
+    fprintf(stderr, "Error : cannot reserve %zu bytes\n", *size);
+    return NULL;
+  }
+  return memory;
+}
+
+
+// creates a heap at the start of address space it reserves
+// full description in header file
+struct heap_t* heap_create_mapped(size_t reserve, const heap_options_t* options)
+{
+  assert(options);
+
+  void* memory = mapping_reserve(&reserve);
+  if (memory == NULL)
+    return NULL;
+
+  // the heap goes first, the same as heap_create_with
+  size_t used = (sizeof(struct heap_t) + MEMORY_ALIGNMENT - 1) & ~(MEMORY_ALIGNMENT - 1);
+  assert(reserve > used + MINIMUM_HEAP_SIZE);
+
+  if (!memory_commit((uintptr_t)memory, (uintptr_t)memory + used))
+  {
+    fprintf(stderr, "Error : cannot commit memory for heap\n");
+    munmap(memory, reserve);
+    return NULL;
+  }
+
+  struct heap_t* heap = (struct heap_t*)memory;
+  heap_init(heap, (uint8_t*)memory + used, reserve - used, options, 1);
+  heap->mapping      = memory;
+  heap->mapping_size = reserve;
+  return heap;
+}
+
+
+// full description in header file
+struct heap_t* heap_create(void* memory, size_t size, char* algorithm)
+{
+  heap_options_t options = { .algorithm = algorithm };
+  return heap_create_with(memory, size, &options);
+}
+
+
+// full description in header file
+void heap_destroy(struct heap_t* heap)
+{
+  assert(heap);
+
+  // remove it from the list of heaps, threads
+  // will forget anything they cached from it
+  pthread_mutex_lock(&heaps_lock);
+  struct heap_t** h = &heaps;
+  while (*h && *h != heap)
+    h = &(*h)->next_heap;
+
+  if (*h)
+    *h = heap->next_heap;
+  pthread_mutex_unlock(&heaps_lock);
+
+  reclaim_stop(heap);
+
+  for (unsigned i = 0; i < heap->arena_count; i++)
+    pthread_mutex_destroy(&heap->arenas[i].lock);
+
+  // a mapped heap lives in its own mapping, so this goes last
+  if (heap->mapping)
+    munmap(heap->mapping, heap->mapping_size);
+}
+
+
+/**
+*
+* Allocates a node from one arena
+*
+* @param heap : The heap the arena belongs to
+* @param arena : The arena to allocate from
+* @param bytes : Bytes of memory to allocate, already rounded
+* @param alignment : What the memory has to be aligned to, 1 for anything
+*
+* @return Pointer to the allocated node or NULL if nothing fits.
+*
+*/
+static struct node_t* arena_allocate(struct heap_t* heap, struct arena_t* arena, size_t bytes, size_t alignment)
+{
+  // top up the thread's cache while we have the lock
+  struct tcache_t* cache = NULL;
+  if (alignment == 1 && bytes <= TCACHE_MAX_SIZE)
+    cache = tcache_get(heap);
+
+  arena_lock(arena);
+
+  struct node_t* p = take_node(heap, arena, bytes, alignment);
+
+  if (p && cache)
+    tcache_fill(cache, arena, bytes);
+
+  arena_unlock(arena);
+  return p;
+}
+
+
+/**
+*
+* Works out the size of node an allocation is given, which the
+* node it ends up with is at least as big as
+*
+* @param heap : The heap to allocate from
+* @param bytes : The amount of memory requested
+*
+* @return The size of the node.
+*
+*/
+static size_t block_size(struct heap_t* heap, size_t bytes)
+{
+  bytes = request_size(bytes);
+
+  // a buddy block's whole size, so thread caches keep them by that
+  if (heap->find_node == find_buddy && bytes <= TCACHE_MAX_SIZE)
+    bytes = buddy_block(bytes, 1) - sizeof(struct node_t);
+
+  return bytes;
+}
+
+
+/**
+ *
+ * Returns a node with room for the specified size, its memory
+ * is left as it is.
+ *
+ * Small blocks come from the thread's cache if it has one, otherwise
+ * the thread's arena is locked and the heap's algorithm finds a node.
+ * If the arena is full its neighbours are tried in turn.
+ *
+ * @param heap : The heap to allocate from
+ * @param bytes : Bytes of memory to allocate
+ * @param alignment : What the memory has to be aligned to, 1 for anything
+ *
+ * @return Pointer to the allocated node or NULL if nothing fits.
+ *
+*/
+static struct node_t* heap_allocate_node(struct heap_t* heap, size_t bytes, size_t alignment)
+{
+  assert(heap);
+  assert(bytes > 0);
+  INSTRUMENT(INSTRUMENT_SIZE, bytes);
+  bytes = block_size(heap, bytes);
+
+  // allocate called before initialise
+  assert(heap->arenas);
+
+  struct node_t* p = NULL;
+
+  // big blocks get a mapping of their own so they don't fragment the
+  // arenas, if that fails they can still come from an arena
+  if (bytes >= heap->mmap_threshold && (p = node_map(bytes, alignment, heap->huge_pages)))
+  {
+    STAT_COUNT(heap->mapped_blocks, 1);
+    STAT_COUNT(heap->mapped_bytes, node_size(p));
+    STAT_COUNT(heap->arenas[home_arena(heap)].allocations, 1);
+    return p;
+  }
+
+  if (alignment == 1 && bytes <= TCACHE_MAX_SIZE)
+    p = tcache_pop(heap, bytes);
+
+  if (p)
+  {
+    STAT_COUNT(arena_of(heap, p)->allocations, 1);
+    return p;
+  }
+
+  unsigned home = home_arena(heap);
+
+  // the untouched end of the arena needs no lock
+  if (alignment == 1 && (p = wild_allocate(&heap->arenas[home], bytes)))
+  {
+    STAT_COUNT(heap->arenas[home].allocations, 1);
+    return p;
+  }
+
+  // the memory we need might be sitting in our cache,
+  // if so give it back and try again
+  do
+  {
+    for (unsigned i = 0; i < heap->arena_count && p == NULL; i++)
+      p = arena_allocate(heap, &heap->arenas[(home + i) % heap->arena_count], bytes, alignment);
+
+    if (p)
+    {
+      STAT_COUNT(arena_of(heap, p)->allocations, 1);
+      return p;
+    }
+  } while (tcache_flush_all(tcache_get(heap)));
+
+  // nothing found so return NULL
+  STAT_COUNT(heap->arenas[home].failed_allocations, 1);
+  return NULL;
+}
+
+
+// full description in header file
+void* heap_allocate_uninitialised(struct heap_t* heap, size_t bytes)
+{
+  struct node_t* p = heap_allocate_node(heap, bytes, 1);
+  TRACE(TRACE_ALLOCATE_UNINITIALISED, bytes, 0, NULL, p ? p->memory : NULL);
+  return p ? p->memory : NULL;
+}
+
+
+// full description in header file
+void* heap_allocate(struct heap_t* heap, size_t bytes)
+{
+  struct node_t* p = heap_allocate_node(heap, bytes, 1);
+  TRACE(TRACE_ALLOCATE, bytes, 0, NULL, p ? p->memory : NULL);
+
+  if (p == NULL)
+    return NULL;
+
+  // only what was asked for needs zeroing, not the whole block,
+  // and we don't hold any locks while we do it. A new mapping
+  // is already zeroed.
+  if (!node_is_mapped(p))
+    memset(p->memory, 0, bytes);
+  return p->memory;
+}
+
+
+/**
+*
+* Frees a node from an arena, unless it has been freed already. It
+* goes to the thread's cache if it will fit and that is allowed,
+* otherwise it is queued on its arena if frees are deferred or the
+* arena isn't the one this thread uses, and released with the arena
+* locked if not. All the ways of freeing a block come here.
+*
+* @param heap : The heap the node was allocated from
+* @param p : The node to free
+* @param size : What block_size() gave when it was allocated,
+*               or 0 to read it from the header
+* @param cache : Whether it can go to the thread's cache, which
+*                can't be used while an arena is locked
+* @param locked : The arena this thread has locked, or NULL
+*
+* @return The arena this thread has locked afterwards, or NULL.
+*
+*/
+static struct arena_t* arena_free(struct heap_t* heap, struct node_t* p,
+  size_t size, int cache, struct arena_t* locked)
+{
+  assert(!cache || locked == NULL);
+
+  struct arena_t* arena = arena_of(heap, p);
+  size_t bytes = size ? size : node_size(p);
+  cache = cache && bytes <= TCACHE_MAX_SIZE;
+
+  // a block freed again while it waits on a pending list is marked in
+  // its memory. Blocks given a size that the thread cache will take
+  // don't have their header read, anything else has it read anyway
+  if (((size == 0 || !cache) && node_is_free(p)) || node_is_pending(arena, p))
+  {
+    fprintf(stderr, "Error : memory already free\n");
+    return locked;
+  }
+
+  STAT_COUNT(arena->deallocations, 1);
+
+  // small blocks stay with this thread
+  if (cache && tcache_push(heap, p, bytes))
+    return locked;
+
+  // the threads using the arena, or the reclaimer, will release it
+  if (heap->deferred_frees || arena != &heap->arenas[home_arena(heap)])
+  {
+    free_later(arena, p);
+    return locked;
+  }
+
+  if (arena != locked)
+  {
+    if (locked)
+      arena_unlock(locked);
+    arena_lock(arena);
+  }
+
+  release_node(arena, p);
+  return arena;
+}
+
+
+/**
+*
+* Gives an allocated node back, to the thread's cache if it
+* will fit or to the arena it came from. That arena is only
+* locked if it is the one this thread uses.
+*
+* @param heap : The heap the node was allocated from
+* @param p : The node to release
+* @param size : What block_size() gave when it was allocated,
+*               or 0 to read it from the header
+*
+*/
+static void heap_release(struct heap_t* heap, struct node_t* p, size_t size)
+{
+  // anything smaller than the threshold can't have been mapped
+  if ((size == 0 || size >= heap->mmap_threshold) && node_is_mapped(p))
+  {
+    STAT_COUNT(heap->arenas[home_arena(heap)].deallocations, 1);
+    STAT_COUNT(heap->mapped_blocks, -1);
+    STAT_COUNT(heap->mapped_bytes, -node_size(p));
+    node_unmap(p);
+    return;
+  }
+
+  // the block goes back to whichever arena it came from
+  struct arena_t* locked = arena_free(heap, p, size, 1, NULL);
+  if (locked)
+    arena_unlock(locked);
+}
+
+
+// Deallocates memory
+// full description in header file
+void heap_deallocate(struct heap_t* heap, void* memory)
+{  
+  assert(heap);
+
+  // if deallocate was called before initialise
+  assert(heap->arenas);
+
+  // should be ok to pass in NULL
+  if (memory == NULL)
+    return;
+
+  // memory is a pointer to the data so recover the header
+  struct node_t* p = ((struct node_t*)memory) - 1;
+
+  // check memory is is in heaps address space, or has its own mapping
+  assert(node_is_mapped(p) || ((uintptr_t)memory >= heap->arena_base &&
+    (uintptr_t)memory < heap->arena_base + heap->heap_size));
+
+  // traced before it is freed, so it comes before
+  // anything that gets the same memory afterwards
+  TRACE(TRACE_DEALLOCATE, 0, 0, NULL, memory);
+  heap_release(heap, p, 0);
+}
+
+
+// full description in header file
+void heap_deallocate_sized(struct heap_t* heap, void* memory, size_t bytes)
+{
+  assert(heap);
+  assert(heap->arenas);
+
+  if (memory == NULL)
+    return;
+
+  struct node_t* p = ((struct node_t*)memory) - 1;
+
+  // what it was allocated with tells us where it goes without
+  // asking the header, as long as it was the right size. Only
+  // blocks as big as the threshold can have been mapped
+  size_t size = block_size(heap, bytes ? bytes : 1);
+
+  assert((size >= heap->mmap_threshold && node_is_mapped(p)) ||
+    ((uintptr_t)memory >= heap->arena_base &&
+    (uintptr_t)memory < heap->arena_base + heap->heap_size));
+
+#ifdef _DEBUG
+  // the header is only read to check the caller
+  assert(node_size(p) >= size);
+#endif
+
+  TRACE(TRACE_DEALLOCATE, 0, 0, NULL, memory);
+  heap_release(heap, p, size);
+}
+
+
+// full description in header file
+size_t heap_allocate_batch(struct heap_t* heap, size_t count, size_t bytes, void* memory[])
+{
+  assert(heap);
+  assert(bytes > 0);
+
+  // allocate called before initialise
+  assert(heap->arenas);
+
+  size_t size = request_size(bytes);
+  size_t taken = 0;
+  unsigned home = home_arena(heap);
+
+  // big blocks each get a mapping of their own
+  if (size >= heap->mmap_threshold)
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      memory[taken] = heap_allocate(heap, bytes);
+      if (memory[taken])
+        taken++;
+    }
+
+    for (size_t i = taken; i < count; i++)
+      memory[i] = NULL;
+    return taken;
+  }
+
+#ifdef MM_INSTRUMENT
+  for (size_t i = 0; i < count; i++)
+    INSTRUMENT(INSTRUMENT_SIZE, bytes);
+#endif
+
+  for (unsigned i = 0; i < heap->arena_count && taken < count; i++)
+  {
+    struct arena_t* arena = &heap->arenas[(home + i) % heap->arena_count];
+
+    arena_lock(arena);
+    size_t n = take_nodes(heap, arena, count - taken, size, memory + taken);
+    arena_unlock(arena);
+
+    STAT_COUNT(arena->allocations, n);
+    taken += n;
+  }
+
+  if (taken < count)
+    STAT_COUNT(heap->arenas[home].failed_allocations, count - taken);
+
+  for (size_t i = 0; i < taken; i++)
+  {
+    memset(memory[i], 0, bytes);
+    TRACE(TRACE_ALLOCATE, bytes, 0, NULL, memory[i]);
+  }
+
+  for (size_t i = taken; i < count; i++)
+    memory[i] = NULL;
+
+  return taken;
+}
+
+
+// sorts memory into address order
+static int compare_addresses(const void* a, const void* b)
+{
+  uintptr_t x = (uintptr_t)*(void* const*)a;
+  uintptr_t y = (uintptr_t)*(void* const*)b;
+  return (x > y) - (x < y);
+}
+
+
+// full description in header file
+void heap_deallocate_batch(struct heap_t* heap, void* memory[], size_t count)
+{
+  assert(heap);
+
+  // if deallocate was called before initialise
+  assert(heap->arenas);
+
+  // in address order every arena's blocks are together, and each
+  // block is freed right after its neighbour so it coalesces with it
+  qsort(memory, count, sizeof(void*), compare_addresses);
+
+  struct arena_t* locked = NULL;
+
+  for (size_t i = 0; i < count; i++)
+  {
+    // should be ok to pass in NULL
+    if (memory[i] == NULL)
+      continue;
+
+    struct node_t* p = ((struct node_t*)memory[i]) - 1;
+
+    // it isn't in an arena, so there's nothing to lock
+    if (node_is_mapped(p))
+    {
+      TRACE(TRACE_DEALLOCATE, 0, 0, NULL, memory[i]);
+      heap_release(heap, p, 0);
+      continue;
+    }
+
+    // check memory is is in heaps address space
+    assert((uintptr_t)memory[i] >= heap->arena_base &&
+      (uintptr_t)memory[i] < heap->arena_base + heap->heap_size);
+
+    // batches skip the thread cache, and keep an arena
+    // locked while its blocks are freed one after another
+    TRACE(TRACE_DEALLOCATE, 0, 0, NULL, memory[i]);
+    locked = arena_free(heap, p, 0, 0, locked);
+  }
+
+  if (locked)
+    arena_unlock(locked);
+}
+
+
+// full description in header file
+void* heap_allocate_aligned(struct heap_t* heap, size_t alignment, size_t bytes)
+{
+  // must be a power of two
+  assert(alignment && (alignment & (alignment - 1)) == 0);
+
+  // nodes have to stay aligned
+  if (alignment < MEMORY_ALIGNMENT)
+    alignment = MEMORY_ALIGNMENT;
+
+  struct node_t* p = heap_allocate_node(heap, bytes, alignment);
+  TRACE(TRACE_ALLOCATE_ALIGNED, bytes, alignment, NULL, p ? p->memory : NULL);
+
+  if (p == NULL)
+    return NULL;
+
+  if (!node_is_mapped(p))
+    memset(p->memory, 0, bytes);
+  return p->memory;
+}
+
+
+// Reallocates memory, in place if it can
+// full description in header file
+void* heap_reallocate(struct heap_t* heap, void* memory, size_t bytes)
+{
+  assert(heap);
+
+  if (memory == NULL)
+  {
+    struct node_t* p = heap_allocate_node(heap, bytes, 1);
+    TRACE(TRACE_REALLOCATE, bytes, 0, NULL, p ? p->memory : NULL);
+    return p ? p->memory : NULL;
+  }
+
+  // memory is a pointer to the data so recover the header
+  struct node_t* p = ((struct node_t*)memory) - 1;
+  assert(!node_is_free(p));
+
+  // check memory is is in heaps address space, or has its own mapping
+  assert(node_is_mapped(p) || ((uintptr_t)memory >= heap->arena_base &&
+    (uintptr_t)memory < heap->arena_base + heap->heap_size));
+
+  if (bytes == 0)
+  {
+    TRACE(TRACE_REALLOCATE, 0, 0, memory, NULL);
+    heap_release(heap, p, 0);
+    return NULL;
+  }
+
+  size_t size = request_size(bytes);
+  size_t old_size = node_size(p);
+  int resized = 1;
+
+  if (node_is_mapped(p))
+  {
+    // a mapping shrinks in place unless it's small enough for the
+    // arenas, anything else means moving it
+    resized = size <= old_size && size >= heap->mmap_threshold;
+    if (resized)
+      STAT_COUNT(heap->mapped_bytes, -node_unmap_tail(p, size));
+  }
+  else
+  {
+    struct arena_t* arena = arena_of(heap, p);
+
+    arena_lock(arena);
+    if (size <= node_size(p))
+      shrink_node(arena, p, size);
+    else
+      resized = grow_node(arena, p, size);
+    arena_unlock(arena);
+  }
+
+  if (resized)
+  {
+    TRACE(TRACE_REALLOCATE, bytes, 0, memory, memory);
+    return memory;
+  }
+
+  // the next node isn't free, so we have to move it
+  struct node_t* moved = heap_allocate_node(heap, bytes, 1);
+  TRACE(TRACE_REALLOCATE, bytes, 0, memory, moved ? moved->memory : NULL);
+
+  if (moved == NULL)
+    return NULL;
+
+  memcpy(moved->memory, memory, old_size < bytes ? old_size : bytes);
+  heap_release(heap, p, 0);
+  return moved->memory;
+}
+
+
+// full description in header file
+void set_thread_node(int node)
+{
+  // the cpu is only used to simulate nodes, which it
+  // shouldn't be when the thread has said where it is
+  thread_node = node;
+  thread_cpu  = -1;
+}
+
+
+/*...........................................................................*/
+/*..                          DEFAULT HEAP                                 ..*/
+/*...........................................................................*/
+
+
+static void* allocate_default(size_t bytes)
+{
+  return heap_allocate(&default_heap, bytes);
+}
+
+
+// full description in header file
+void initialise_with(void* memory, size_t size, const heap_options_t* options)
+{
+  assert(options);
+
+  // the heap may have been mapped before
+  void*  mapping = default_heap.mapping;
+  size_t mapping_size = default_heap.mapping_size;
+
+  heap_init(&default_heap, memory, size, options, 0);
+  allocate = allocate_default;
+
+  if (mapping)
+    munmap(mapping, mapping_size);
+}
+
+
+// full description in header file
+int initialise_mapped(size_t reserve, const heap_options_t* options)
+{
+  assert(options);
+
+  void* memory = mapping_reserve(&reserve);
+  if (memory == NULL)
+    return -1;
+
+  void*  mapping = default_heap.mapping;
+  size_t mapping_size = default_heap.mapping_size;
+
+  heap_init(&default_heap, memory, reserve, options, 1);
+  default_heap.mapping      = memory;
+  default_heap.mapping_size = reserve;
+  allocate = allocate_default;
+
+  if (mapping)
+    munmap(mapping, mapping_size);
+  return 0;
+}
+
+
+// initilizes memory manager
+// full description in header file
+void initialise(void* memory, size_t size, char* algorithm)
+{
+  heap_options_t options = { .algorithm = algorithm };
+  initialise_with(memory, size, &options);
+}
+
+
+// full description in header file
+void* allocate_uninitialised(size_t bytes)
+{
+  return heap_allocate_uninitialised(&default_heap, bytes);
+}
+
+
+// full description in header file
+size_t allocate_batch(size_t count, size_t bytes, void* memory[])
+{
+  return heap_allocate_batch(&default_heap, count, bytes, memory);
+}
+
+
+// full description in header file
+void deallocate_batch(void* memory[], size_t count)
+{
+  heap_deallocate_batch(&default_heap, memory, count);
+}
+
+
+// full description in header file
+void* allocate_aligned(size_t alignment, size_t bytes)
+{
+  return heap_allocate_aligned(&default_heap, alignment, bytes);
+}
+
+
+// full description in header file
+void deallocate(void* memory)
+{
+  heap_deallocate(&default_heap, memory);
+}
+
+
+// full description in header file
+void deallocate_sized(void* memory, size_t bytes)
+{
+  heap_deallocate_sized(&default_heap, memory, bytes);
+}
+
+
+// full description in header file
+void* reallocate(void* memory, size_t bytes)
+{
+  return heap_reallocate(&default_heap, memory, bytes);
+}
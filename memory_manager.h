@@ -9,11 +9,15 @@
 *  Description: Header file for Basic thread-safe memory manager, allocate   *
 *               and deallocate memory dynamically.                           *
 *                                                                            *
-*               Uses either first-fit, next-fit, best-fit or worst-fit       *
-*               algorithm to allocate memory. This is determined in the      *
-*               initialize function.                                         *
+*               Uses either first-fit, next-fit, best-fit, worst-fit or      *
+*               segregated-fit algorithm to allocate memory. This is         *
+*               determined in the initialize function.                       *
 *                                                                            *
 *               Adjacent free memory blocks will be coalesced.               *
+*                                                                            *
+*               initialise, allocate and deallocate use a default heap,      *
+*               more heaps can be created with heap_create and used with     *
+*               the heap_ functions.                                         *
 *----------------------------------------------------------------------------*
 */
 
@@ -33,6 +37,157 @@ extern "C" {
   #define NEXTFIT  "NextFit"
   #define BESTFIT  "BestFit"
   #define WORSTFIT "WorstFit"
+  #define SEGREGATEDFIT "SegregatedFit"
+  #define BUDDY    "Buddy"
+
+  /**
+   * Macros to aid choosing how threads are given arenas
+  */
+  #define ARENA_ROUND_ROBIN 0
+  #define ARENA_BY_CPU      1
+  #define ARENA_BY_NODE     2
+
+  /**
+   * Macros to aid choosing what kind of lock arenas have
+  */
+  #define LOCK_MUTEX    0
+  #define LOCK_ADAPTIVE 1
+  #define LOCK_TICKET   2
+  #define LOCK_MCS      3
+
+  /**
+   * Handle to a heap created with heap_create()
+  */
+  typedef struct heap_t heap_t;
+
+  /**
+   * Options for initialise_with() and heap_create_with().
+   * Anything left as zero gets the default.
+  */
+  typedef struct heap_options_t
+  {
+    // allocation algorithm to be used, first-fit by default
+    char*    algorithm;
+
+    // number of arenas to split the heap into, each has its own lock
+    // and nodes, so threads using different arenas don't contend
+    unsigned arenas;
+
+    // how threads are given arenas, ARENA_ROUND_ROBIN, ARENA_BY_CPU
+    // or ARENA_BY_NODE
+    unsigned arena_policy;
+
+    // mapped heaps only, how much memory an arena commits at a time,
+    // rounded up to whole pages, 1MB by default
+    size_t   chunk_size;
+
+    // mapped heaps only, how many free chunks an arena keeps before
+    // giving the rest back to the OS, 1 by default
+    unsigned spare_chunks;
+
+    // allocations at least this big get a mapping of their own rather
+    // than coming from the arenas, 256KB by default, SIZE_MAX for never
+    size_t   mmap_threshold;
+
+    // non-zero to back the heap with transparent huge pages where the
+    // OS supports them. A mapped heap's arenas and chunks are lined up
+    // on 2MB, and large blocks of 2MB or more get huge pages too.
+    unsigned huge_pages;
+
+    // ARENA_BY_NODE only, how many NUMA nodes to share the arenas
+    // between. By default it's however many the machine has, giving
+    // more simulates a bigger machine. There are at least as many
+    // arenas as nodes.
+    unsigned numa_nodes;
+
+    // non-zero to defer frees. Freed blocks are queued on their arena
+    // without taking its lock, and a background thread coalesces and
+    // bins them in batches, so frees stay off the allocation path.
+    unsigned deferred_frees;
+
+    // non-zero to carve allocations off the untouched end of an arena
+    // without its lock, until something can't be found in the arena's
+    // free nodes. Not for mapped heaps or the buddy system.
+    unsigned wilderness;
+
+    // the arenas' locks. LOCK_MUTEX, the default, sleeps until the lock
+    // is free. LOCK_ADAPTIVE spins for a while first, LOCK_TICKET spins
+    // and serves threads in the order they arrive, and LOCK_MCS queues
+    // threads so each spins on its own memory. Spinning threads give up
+    // the CPU if the wait goes on. Waits are counted by heap_get_stats().
+    unsigned lock_policy;
+  } heap_options_t;
+
+  /**
+   * How much of a heap is in use, filled in by get_usage()
+   * and heap_get_usage().
+  */
+  typedef struct heap_usage_t
+  {
+    // total size of the heap, including node headers
+    size_t heap_size;
+
+    // bytes handed out, including blocks held in thread caches
+    size_t used_bytes;
+
+    // bytes in free nodes, and how many free nodes there are
+    size_t free_bytes;
+    size_t free_blocks;
+
+    // the biggest request that could currently be met
+    size_t largest_free;
+  } heap_usage_t;
+
+  /**
+   * Running statistics for a heap, filled in by get_stats()
+   * and heap_get_stats().
+  */
+  typedef struct heap_stats_t
+  {
+    // the same as in heap_usage_t, largest_free is
+    // the biggest free node in any one arena
+    size_t heap_size;
+    size_t used_bytes;
+    size_t free_bytes;
+    size_t free_blocks;
+    size_t largest_free;
+
+    // calls that returned memory, freed it, or
+    // returned NULL since the heap was created
+    size_t allocations;
+    size_t deallocations;
+    size_t failed_allocations;
+
+    // how many times a thread had to wait for a lock
+    // and how long they waited in total
+    unsigned long long lock_waits;
+    unsigned long long lock_wait_ns;
+
+    // blocks with a mapping of their own, and their size,
+    // these aren't counted in used_bytes
+    size_t mapped_blocks;
+    size_t mapped_bytes;
+  } heap_stats_t;
+
+  /**
+   * Histograms filled in by get_instrument_report() when built with
+   * MM_INSTRUMENT. Bucket 0 counts zeros and bucket n counts values
+   * from 2^(n-1) up to 2^n - 1.
+  */
+  #define HISTOGRAM_BUCKETS 65
+
+  typedef struct instrument_report_t
+  {
+    // bytes asked for by each allocation
+    unsigned long long request_sizes[HISTOGRAM_BUCKETS];
+
+    // nodes the algorithm looked at to find a free node
+    unsigned long long nodes_visited[HISTOGRAM_BUCKETS];
+
+    // nanoseconds spent waiting for, and holding, arena locks
+    unsigned long long lock_wait_ns[HISTOGRAM_BUCKETS];
+    unsigned long long lock_hold_ns[HISTOGRAM_BUCKETS];
+  } instrument_report_t;
 
   /**
   *
@@ -47,12 +202,55 @@ extern "C" {
   void initialise(void* memory, size_t size, char* algorithm);
 
 
+  /**
+  *
+  * Initializes the memory manager the same as initialise(), but
+  * takes a set of options.
+  *
+  * If more than one arena is asked for, the memory is split evenly
+  * between them. Each thread allocates from its own arena and falls
+  * back to the other arenas when it is full. Memory always goes back
+  * to the arena it came from when deallocated.
+  *
+  * @param memory : Pointer to a block of memory to use as the heap.
+  * @param size : The size of the heap in bytes.
+  * @param options : How the heap should be set up.
+  *
+  */
+  void initialise_with(void* memory, size_t size, const heap_options_t* options);
+
+
+  /**
+  *
+  * Initializes the memory manager the same as initialise_with(), but
+  * instead of taking a block of memory it reserves address space and
+  * commits it a chunk at a time as it is needed.
+  *
+  * Each arena starts with one chunk and commits more when nothing
+  * fits. When the end of an arena has been freed it keeps
+  * spare_chunks of it and gives the rest back to the OS.
+  *
+  * @param reserve : How much address space to reserve, the most the
+  *                  heap can grow to.
+  * @param options : How the heap should be set up.
+  *
+  * @return 0 on success, -1 if the address space couldn't be reserved.
+  *
+  */
+  int initialise_mapped(size_t reserve, const heap_options_t* options);
+
+
   /**
    *
    * Returns a segment of dynamically allocated memory of the specified size.
    *
    * Algorithm used depends on how the memory manager was initilized.
    *
+   * Requests are rounded up to a multiple of two pointers, so the
+   * returned memory is aligned to that relative to the heap.
+   *
+   * The memory is zeroed, like calloc().
+   *
    * @param bytes : Bytes of memory to allocate
    *
    * @return Pointer to new block of memory
@@ -61,6 +259,38 @@ extern "C" {
   extern void* (*allocate)(size_t bytes);
 
 
+  /**
+   *
+   * Returns a segment of dynamically allocated memory of the specified
+   * size, the same as allocate() except the memory is not zeroed,
+   * like malloc().
+   *
+   * @param bytes : Bytes of memory to allocate
+   *
+   * @return Pointer to new block of memory
+   *
+  */
+  void* allocate_uninitialised(size_t bytes);
+
+
+  /**
+   *
+   * Returns a segment of dynamically allocated memory whose address is
+   * a multiple of the given alignment, e.g. 64 for a cache line. Works
+   * with every algorithm and is freed with deallocate() as usual.
+   *
+   * The memory is zeroed, like allocate().
+   *
+   * @param alignment : What the memory has to be aligned to,
+   *                    must be a power of two.
+   * @param bytes : Bytes of memory to allocate
+   *
+   * @return Pointer to new block of memory
+   *
+  */
+  void* allocate_aligned(size_t alignment, size_t bytes);
+
+
   /**
    *
    * Frees a block of dynamically allocated memory
@@ -75,6 +305,77 @@ extern "C" {
   void deallocate(void* memory);
 
 
+  /**
+   *
+   * Frees a block the same as deallocate(), given the number of
+   * bytes it was allocated or last reallocated with. Knowing the
+   * size means the header of a block smaller than the mmap threshold
+   * doesn't have to be read to find where it goes, which is what C++
+   * sized deallocation passes in. Works for memory from
+   * allocate_aligned() too. A block freed twice is caught the same
+   * as by deallocate(), except for a small block the thread cache
+   * has already given back to its arena, whose header isn't read.
+   *
+   * @param memory : Pointer to a block of memory to deallocate.
+   * @param bytes : Bytes it was allocated with.
+   *
+  */
+  void deallocate_sized(void* memory, size_t bytes);
+
+
+  /**
+   *
+   * Changes the size of a block of dynamically allocated memory,
+   * keeping its contents, like realloc().
+   *
+   * Shrinking is always done in place. Growing is done in place if
+   * the block after it is free and big enough, otherwise a new block
+   * is allocated, the contents are copied and the old block is freed.
+   * Any memory added is not zeroed.
+   *
+   * @param memory : Pointer to a block of memory to resize, if NULL
+   *                 this is the same as allocate_uninitialised().
+   * @param bytes : The new size, if 0 this is the same as deallocate().
+   *
+   * @return Pointer to the resized block, or NULL if it won't fit,
+   *         in which case the old block is left as it was.
+   *
+  */
+  void* reallocate(void* memory, size_t bytes);
+
+
+  /**
+   *
+   * Allocates a number of blocks of the same size, taking the lock
+   * once. Where possible the blocks are carved one after another from
+   * a single free block. The memory is zeroed, like allocate().
+   *
+   * @param count : How many blocks to allocate
+   * @param bytes : Bytes of memory in each block
+   * @param memory : Array of count pointers to fill in, any blocks
+   *                 that couldn't be allocated are set to NULL.
+   *
+   * @return How many blocks were allocated.
+   *
+  */
+  size_t allocate_batch(size_t count, size_t bytes, void* memory[]);
+
+
+  /**
+   *
+   * Frees a number of blocks, taking the lock once. The blocks are
+   * freed in address order so neighbours coalesce as they go. Blocks
+   * from arenas other threads use, or every block if frees are
+   * deferred, go on their arena's pending free list without a lock.
+   *
+   * @param memory : Array of pointers to free, may contain NULLs.
+   *                 The array is sorted into address order.
+   * @param count : How many pointers are in the array
+   *
+  */
+  void deallocate_batch(void* memory[], size_t count);
+
+
   /**
    *
    * Prints all the nodes in our memory manager, along with their
@@ -100,9 +401,285 @@ extern "C" {
    * 
   */
   void validate();
+
+
+  /**
+   *
+   * Works out how much of the heap is in use and how fragmented the
+   * free memory is. Like validate() this walks every node, so it is
+   * meant for testing and benchmarking rather than the hot path.
+   *
+   * Fragmentation can be taken as 1 - largest_free / free_bytes.
+   *
+   * @param usage : Where to put the results
+   *
+  */
+  void get_usage(heap_usage_t* usage);
+
+
+  /**
+   *
+   * Reads the heap's statistics. They are kept up to date as memory
+   * is allocated and freed, so this doesn't lock or walk the heap and
+   * is cheap enough to call from anywhere, e.g. to decide when the heap
+   * is too fragmented.
+   *
+   * While other threads are allocating the figures may be slightly
+   * out of step with each other, when nothing else is running they
+   * match get_usage() exactly.
+   *
+   * @param stats : Where to put the results
+   *
+  */
+  void get_stats(heap_stats_t* stats);
+
+
+  /**
+   *
+   * Adds up the histograms every thread has kept, including threads
+   * that have exited, for all heaps. Only filled in when built with
+   * MM_INSTRUMENT, otherwise everything is zero.
+   *
+   * @param report : Where to put the histograms
+   *
+  */
+  void get_instrument_report(instrument_report_t* report);
+
+
+  /**
+   *
+   * Prints the histograms from get_instrument_report().
+   *
+  */
+  void print_instrument_report();
+
+
+  /**
+  *
+  * Creates a new heap over a block of memory. The heap is independent
+  * of the default heap and of any other heap, with its own lock.
+  *
+  * The heap's bookkeeping is stored at the start of the memory,
+  * so slightly less than size bytes can be allocated from it.
+  *
+  * @param memory : Pointer to a block of memory to use as the heap.
+  * @param size : The size of the memory in bytes.
+  * @param algorithm : Allocation algorithm to be used.
+  *
+  * @return Handle to the new heap.
+  *
+  */
+  heap_t* heap_create(void* memory, size_t size, char* algorithm);
+
+
+  /**
+  *
+  * Creates a new heap the same as heap_create(), but takes a set of
+  * options. See initialise_with() for what they do.
+  *
+  * @param memory : Pointer to a block of memory to use as the heap.
+  * @param size : The size of the memory in bytes.
+  * @param options : How the heap should be set up.
+  *
+  * @return Handle to the new heap.
+  *
+  */
+  heap_t* heap_create_with(void* memory, size_t size, const heap_options_t* options);
+
+
+  /**
+  *
+  * Creates a new heap that grows as it's needed, see initialise_mapped().
+  * The heap is unmapped when it is destroyed.
+  *
+  * @param reserve : How much address space to reserve.
+  * @param options : How the heap should be set up.
+  *
+  * @return Handle to the new heap, or NULL if the address
+  *         space couldn't be reserved.
+  *
+  */
+  heap_t* heap_create_mapped(size_t reserve, const heap_options_t* options);
+
+
+  /**
+  *
+  * Destroys a heap. Nothing allocated from it may be used afterwards,
+  * and the memory passed to heap_create can be reused. Blocks given a
+  * mapping of their own are only unmapped when they are deallocated.
+  *
+  * @param heap : The heap to destroy.
+  *
+  */
+  void heap_destroy(heap_t* heap);
+
+
+  /**
+   *
+   * Returns a segment of dynamically allocated memory from a heap.
+   *
+   * The memory is zeroed, like calloc().
+   *
+   * @param heap : The heap to allocate from
+   * @param bytes : Bytes of memory to allocate
+   *
+   * @return Pointer to new block of memory, or NULL if it won't fit
+   *
+  */
+  void* heap_allocate(heap_t* heap, size_t bytes);
+
+
+  /**
+   *
+   * Returns a segment of dynamically allocated memory from a heap
+   * without zeroing it, like malloc().
+   *
+   * @param heap : The heap to allocate from
+   * @param bytes : Bytes of memory to allocate
+   *
+   * @return Pointer to new block of memory, or NULL if it won't fit
+   *
+  */
+  void* heap_allocate_uninitialised(heap_t* heap, size_t bytes);
+
+
+  /**
+   *
+   * Returns aligned memory from a heap, see allocate_aligned().
+   *
+   * @param heap : The heap to allocate from
+   * @param alignment : What the memory has to be aligned to
+   * @param bytes : Bytes of memory to allocate
+   *
+   * @return Pointer to new block of memory, or NULL if it won't fit
+   *
+  */
+  void* heap_allocate_aligned(heap_t* heap, size_t alignment, size_t bytes);
+
+
+  /**
+   *
+   * Frees a block of memory allocated from a heap.
+   *
+   * @param heap : The heap the memory was allocated from
+   * @param memory : Pointer to a block of memory to deallocate.
+   *
+  */
+  void heap_deallocate(heap_t* heap, void* memory);
+
+
+  /**
+   *
+   * Frees a block of memory allocated from a heap, given the number
+   * of bytes it was allocated with, see deallocate_sized().
+   *
+   * @param heap : The heap the memory was allocated from
+   * @param memory : Pointer to a block of memory to deallocate.
+   * @param bytes : Bytes it was allocated with.
+   *
+  */
+  void heap_deallocate_sized(heap_t* heap, void* memory, size_t bytes);
+
+
+  /**
+   *
+   * Changes the size of a block of memory allocated from a heap,
+   * see reallocate().
+   *
+   * @param heap : The heap the memory was allocated from
+   * @param memory : Pointer to a block of memory to resize.
+   * @param bytes : The new size.
+   *
+   * @return Pointer to the resized block, or NULL if it won't fit.
+   *
+  */
+  void* heap_reallocate(heap_t* heap, void* memory, size_t bytes);
+
+
+  /**
+   *
+   * Allocates a number of blocks from a heap, see allocate_batch().
+   *
+   * @param heap : The heap to allocate from
+   * @param count : How many blocks to allocate
+   * @param bytes : Bytes of memory in each block
+   * @param memory : Array of count pointers to fill in
+   *
+   * @return How many blocks were allocated.
+   *
+  */
+  size_t heap_allocate_batch(heap_t* heap, size_t count, size_t bytes, void* memory[]);
+
+
+  /**
+   *
+   * Frees a number of blocks from a heap, see deallocate_batch().
+   *
+   * @param heap : The heap the memory was allocated from
+   * @param memory : Array of pointers to free
+   * @param count : How many pointers are in the array
+   *
+  */
+  void heap_deallocate_batch(heap_t* heap, void* memory[], size_t count);
+
+
+  /**
+   *
+   * Prints all the nodes in a heap.
+   *
+   * @param heap : The heap to print
+   *
+  */
+  void heap_print_all_nodes(heap_t* heap);
+
+
+  /**
+   *
+   * Validates a heap, the same as validate() does for the default heap.
+   *
+   * @param heap : The heap to validate
+   *
+  */
+  void heap_validate(heap_t* heap);
+
+
+  /**
+   *
+   * Works out how much of a heap is in use, see get_usage().
+   *
+   * @param heap : The heap to look at
+   * @param usage : Where to put the results
+   *
+  */
+  void heap_get_usage(heap_t* heap, heap_usage_t* usage);
+
+
+  /**
+   *
+   * Reads a heap's statistics without locking, see get_stats().
+   *
+   * @param heap : The heap to look at
+   * @param stats : Where to put the results
+   *
+  */
+  void heap_get_stats(heap_t* heap, heap_stats_t* stats);
+
+
+  /**
+  *
+  * Says which NUMA node the calling thread is on, for heaps using
+  * ARENA_BY_NODE. Otherwise the OS is asked the first time the
+  * thread allocates, which is wrong if it later moves to another
+  * node, so threads pinned to a node can say so here. Also useful
+  * for simulating nodes the machine doesn't have.
+  *
+  * @param node : The thread's node, or -1 to ask the OS again.
+  *
+  */
+  void set_thread_node(int node);
   
 #ifdef __cplusplus
 }
 #endif
 
-#endif
\ No newline at end of file
+#endif
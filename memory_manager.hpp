@@ -0,0 +1,227 @@
+/*
+*----------------------------------------------------------------------------*
+*  memory_manager.hpp                                                        *
+*                                                                            *
+*  Description: C++ adapters for the memory manager, so standard containers  *
+*               can allocate from a heap. Needs C++17.                       *
+*                                                                            *
+*               heap_resource is a std::pmr::memory_resource over a heap,    *
+*               for the std::pmr containers. heap_allocator<T> is an         *
+*               allocator holding the heap it uses, and                      *
+*               default_heap_allocator<T> one that always uses the default   *
+*               heap and so takes no space in the container.                 *
+*                                                                            *
+*               Containers always say how big a block was when they free     *
+*               it, so that is passed on to heap_deallocate_sized().         *
+*----------------------------------------------------------------------------*
+*/
+
+#ifndef MEMORY_MANAGER_HPP__
+#define MEMORY_MANAGER_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <limits>
+#include <type_traits>
+#include <memory_resource>
+
+#include "memory_manager.h"
+
+namespace memory_manager
+{
+  /**
+   * Every block is aligned to at least this, anything
+   * more has to be asked for with allocate_aligned()
+  */
+  constexpr std::size_t natural_alignment = 2 * sizeof(void*);
+
+  namespace detail
+  {
+    // a null heap means the default heap
+    inline void* allocate(heap_t* heap, std::size_t bytes, std::size_t alignment)
+    {
+      // the heap won't allocate nothing
+      if (bytes == 0)
+        bytes = 1;
+
+      void* memory;
+      if (alignment <= natural_alignment)
+        memory = heap ? heap_allocate_uninitialised(heap, bytes) : allocate_uninitialised(bytes);
+      else
+        memory = heap ? heap_allocate_aligned(heap, alignment, bytes) : allocate_aligned(alignment, bytes);
+
+      if (memory == nullptr)
+        throw std::bad_alloc();
+      return memory;
+    }
+
+    inline void deallocate(heap_t* heap, void* memory, std::size_t bytes)
+    {
+      if (bytes == 0)
+        bytes = 1;
+
+      if (heap)
+        heap_deallocate_sized(heap, memory, bytes);
+      else
+        deallocate_sized(memory, bytes);
+    }
+  }
+
+
+  /**
+  *
+  * A memory resource that allocates from a heap, e.g.
+  *
+  *   heap_resource resource(heap);
+  *   std::pmr::vector<int> v(&resource);
+  *
+  * The heap has to outlive everything allocated through it.
+  *
+  */
+  class heap_resource : public std::pmr::memory_resource
+  {
+  public:
+    /**
+    *
+    * @param heap : The heap to allocate from, or nullptr for
+    *               the default heap.
+    *
+    */
+    explicit heap_resource(heap_t* heap = nullptr) noexcept : heap_(heap) {}
+
+    heap_t* heap() const noexcept { return heap_; }
+
+  protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+      return detail::allocate(heap_, bytes, alignment);
+    }
+
+    void do_deallocate(void* memory, std::size_t bytes, std::size_t alignment) override
+    {
+      // aligned blocks are freed the same as any other
+      (void)alignment;
+      detail::deallocate(heap_, memory, bytes);
+    }
+
+    // resources over the same heap can free each other's memory
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+      const heap_resource* resource = dynamic_cast<const heap_resource*>(&other);
+      return resource && resource->heap_ == heap_;
+    }
+
+  private:
+    heap_t* heap_;
+  };
+
+
+  /**
+  *
+  * An allocator for standard containers that allocates from a heap, e.g.
+  *
+  *   std::vector<int, heap_allocator<int>> v(heap_allocator<int>(heap));
+  *
+  * Allocators over the same heap are equal, so containers can
+  * swap and move their memory between them.
+  *
+  */
+  template <class T>
+  class heap_allocator
+  {
+  public:
+    typedef T value_type;
+
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    /**
+    *
+    * @param heap : The heap to allocate from, or nullptr for
+    *               the default heap.
+    *
+    */
+    explicit heap_allocator(heap_t* heap = nullptr) noexcept : heap_(heap) {}
+
+    template <class U>
+    heap_allocator(const heap_allocator<U>& other) noexcept : heap_(other.heap()) {}
+
+    heap_t* heap() const noexcept { return heap_; }
+
+    T* allocate(std::size_t n)
+    {
+      if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+        throw std::bad_array_new_length();
+      return static_cast<T*>(detail::allocate(heap_, n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* memory, std::size_t n) noexcept
+    {
+      detail::deallocate(heap_, memory, n * sizeof(T));
+    }
+
+  private:
+    heap_t* heap_;
+  };
+
+  template <class T, class U>
+  bool operator==(const heap_allocator<T>& a, const heap_allocator<U>& b) noexcept
+  {
+    return a.heap() == b.heap();
+  }
+
+  template <class T, class U>
+  bool operator!=(const heap_allocator<T>& a, const heap_allocator<U>& b) noexcept
+  {
+    return a.heap() != b.heap();
+  }
+
+
+  /**
+  *
+  * An allocator for standard containers that allocates from the
+  * default heap, which has to be initialised first. It has nothing
+  * in it, so it adds nothing to the size of a container.
+  *
+  */
+  template <class T>
+  class default_heap_allocator
+  {
+  public:
+    typedef T value_type;
+    typedef std::true_type is_always_equal;
+
+    default_heap_allocator() noexcept = default;
+
+    template <class U>
+    default_heap_allocator(const default_heap_allocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n)
+    {
+      if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+        throw std::bad_array_new_length();
+      return static_cast<T*>(detail::allocate(nullptr, n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* memory, std::size_t n) noexcept
+    {
+      detail::deallocate(nullptr, memory, n * sizeof(T));
+    }
+  };
+
+  template <class T, class U>
+  bool operator==(const default_heap_allocator<T>&, const default_heap_allocator<U>&) noexcept
+  {
+    return true;
+  }
+
+  template <class T, class U>
+  bool operator!=(const default_heap_allocator<T>&, const default_heap_allocator<U>&) noexcept
+  {
+    return false;
+  }
+}
+
+#endif
@@ -0,0 +1,710 @@
+/*
+*----------------------------------------------------------------------------*
+*  memory_manager_bench.c                                                    *
+*                                                                            *
+*  Description: Benchmarks for the thread-safe memory manager.               *
+*                                                                            *
+*               Runs a set of standard workloads against every allocation    *
+*               algorithm, and against the system malloc as a baseline,      *
+*               at 1 to N threads. For each run it reports operations per    *
+*               second, p50/p99/p999 latency of a single allocate or         *
+*               deallocate, and the peak fragmentation of the heap.          *
+*                                                                            *
+*               Every thread has its own seeded random number generator,     *
+*               so a run with the same options does the same operations.     *
+*                                                                            *
+*               --lock picks the kind of lock the heaps' arenas have, or     *
+*               all to compare them, and how many times threads had to       *
+*               wait for a lock is reported with each run.                   *
+*----------------------------------------------------------------------------*
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "memory_manager.h"
+
+
+// defaults, all can be changed on the command line
+#define DEFAULT_THREADS   4
+#define DEFAULT_OPS       100000
+#define DEFAULT_SEED      1
+#define DEFAULT_HEAP_MB   64
+
+// live blocks each thread keeps for the random workloads
+#define SLOT_COUNT 1024
+
+// blocks in flight between a producer and its consumer
+#define QUEUE_SIZE 256
+
+// how many times larson-style threads swap their blocks
+#define LARSON_ROUNDS 8
+
+// thread 0 measures fragmentation every this many operations
+#define USAGE_INTERVAL 4096
+
+
+/*...........................................................................*/
+/*..                          RANDOM NUMBERS                               ..*/
+/*...........................................................................*/
+
+
+// xorshift64*, small and fast, and the same everywhere unlike rand()
+static uint64_t random_next(uint64_t* state)
+{
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+// a random number from start to end inclusive
+static size_t random_range(uint64_t* state, size_t start, size_t end)
+{
+  return start + (size_t)(random_next(state) % (end - start + 1));
+}
+
+// a random number from 0 to 1, never 0
+static double random_unit(uint64_t* state)
+{
+  return ((random_next(state) >> 11) + 1) * (1.0 / 9007199254740993.0);
+}
+
+// seeds are spread out so each thread gets a different sequence
+static uint64_t random_seed(uint64_t seed, unsigned thread)
+{
+  uint64_t state = (seed + 1) * 0x9E3779B97F4A7C15ULL + thread;
+  random_next(&state);
+  return state ? state : 1;
+}
+
+
+/*...........................................................................*/
+/*..                          ALLOCATORS                                   ..*/
+/*...........................................................................*/
+
+
+// an allocator being benchmarked, a heap with one of the
+// algorithms, or the system malloc when algorithm is NULL
+struct allocator_t
+{
+  const char* name;
+  char*       algorithm;
+};
+
+static const struct allocator_t allocators[] =
+{
+  { "FirstFit",      FIRSTFIT      },
+  { "NextFit",       NEXTFIT       },
+  { "BestFit",       BESTFIT       },
+  { "WorstFit",      WORSTFIT      },
+  { "SegregatedFit", SEGREGATEDFIT },
+  { "Buddy",         BUDDY         },
+  { "malloc",        NULL          },
+};
+
+#define ALLOCATOR_COUNT (sizeof(allocators) / sizeof(allocators[0]))
+
+// kinds of arena lock, for --lock
+struct lock_policy_t
+{
+  const char* name;
+  unsigned    policy;
+};
+
+static const struct lock_policy_t lock_policies[] =
+{
+  { "mutex",    LOCK_MUTEX    },
+  { "adaptive", LOCK_ADAPTIVE },
+  { "ticket",   LOCK_TICKET   },
+  { "mcs",      LOCK_MCS      },
+};
+
+#define LOCK_POLICY_COUNT (sizeof(lock_policies) / sizeof(lock_policies[0]))
+
+// the heap for the current run, NULL when benchmarking malloc
+static heap_t* bench_heap;
+
+static void* bench_allocate(size_t bytes)
+{
+  if (!bench_heap)
+    return malloc(bytes);
+  return heap_allocate_uninitialised(bench_heap, bytes);
+}
+
+static void bench_deallocate(void* memory)
+{
+  if (!bench_heap)
+    free(memory);
+  else
+    heap_deallocate(bench_heap, memory);
+}
+
+
+/*...........................................................................*/
+/*..                          MEASURING                                    ..*/
+/*...........................................................................*/
+
+
+static uint64_t now_ns()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+// everything one thread does in a run
+struct thread_t
+{
+  pthread_t thread;
+  unsigned  id;
+  uint64_t  random;
+
+  // latency of each operation in nanoseconds
+  uint32_t* latencies;
+  size_t    ops;
+  size_t    capacity;
+  size_t    failed;
+
+  // blocks the thread is holding
+  void*     slots[SLOT_COUNT];
+};
+
+// settings and shared state for a run
+struct run_t
+{
+  unsigned  threads;
+  size_t    ops;
+
+  struct thread_t* thread;
+
+  // worst fragmentation seen, measured by thread 0
+  double    peak_fragmentation;
+
+  // used by the producer/consumer and larson workloads
+  struct queue_t*   queues;
+  pthread_barrier_t barrier;
+  void**            larson_slots;
+};
+
+static struct run_t run;
+
+
+// writes to the memory so the allocator can't get away with
+// handing out memory nobody touches
+static void touch(void* memory, size_t bytes)
+{
+  ((volatile uint8_t*)memory)[0] = (uint8_t)bytes;
+  ((volatile uint8_t*)memory)[bytes - 1] = (uint8_t)bytes;
+}
+
+static void record(struct thread_t* t, uint64_t start)
+{
+  uint64_t elapsed = now_ns() - start;
+
+  if (t->ops < t->capacity)
+    t->latencies[t->ops] = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+  t->ops++;
+}
+
+static void measure_usage(struct thread_t* t)
+{
+  if (t->id != 0 || !bench_heap || t->ops % USAGE_INTERVAL)
+    return;
+
+  heap_usage_t usage;
+  heap_get_usage(bench_heap, &usage);
+
+  if (usage.free_bytes)
+  {
+    double fragmentation = 1.0 - (double)usage.largest_free / usage.free_bytes;
+    if (fragmentation > run.peak_fragmentation)
+      run.peak_fragmentation = fragmentation;
+  }
+}
+
+// allocates into a slot, timing it
+static void timed_allocate(struct thread_t* t, void** slot, size_t bytes)
+{
+  uint64_t start = now_ns();
+  *slot = bench_allocate(bytes);
+  record(t, start);
+
+  if (*slot)
+    touch(*slot, bytes);
+  else
+    t->failed++;
+
+  measure_usage(t);
+}
+
+// deallocates a slot, timing it
+static void timed_deallocate(struct thread_t* t, void** slot)
+{
+  uint64_t start = now_ns();
+  bench_deallocate(*slot);
+  record(t, start);
+  *slot = NULL;
+
+  measure_usage(t);
+}
+
+static void free_slots(void** slots, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    if (slots[i])
+      bench_deallocate(slots[i]);
+    slots[i] = NULL;
+  }
+}
+
+
+/*...........................................................................*/
+/*..                          WORKLOADS                                    ..*/
+/*...........................................................................*/
+
+
+// picks a random slot, frees it if it's in use otherwise
+// fills it with a block of 16 to 512 bytes
+static void* uniform_small(void* arg)
+{
+  struct thread_t* t = arg;
+
+  while (t->ops < run.ops)
+  {
+    void** slot = &t->slots[random_range(&t->random, 0, SLOT_COUNT - 1)];
+
+    if (*slot)
+      timed_deallocate(t, slot);
+    else
+      timed_allocate(t, slot, random_range(&t->random, 16, 512));
+  }
+
+  free_slots(t->slots, SLOT_COUNT);
+  return NULL;
+}
+
+
+// the same as uniform_small but sizes follow a log-normal
+// distribution, mostly small with a long tail up to 32 KB
+static void* log_normal(void* arg)
+{
+  struct thread_t* t = arg;
+
+  while (t->ops < run.ops)
+  {
+    void** slot = &t->slots[random_range(&t->random, 0, SLOT_COUNT - 1)];
+
+    if (*slot)
+      timed_deallocate(t, slot);
+    else
+    {
+      // box-muller, median of 64 bytes
+      double u = random_unit(&t->random);
+      double v = random_unit(&t->random);
+      double normal = sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+      double bytes = exp(log(64.0) + normal);
+
+      if (bytes < 1.0)
+        bytes = 1.0;
+      if (bytes > 32768.0)
+        bytes = 32768.0;
+
+      timed_allocate(t, slot, (size_t)bytes);
+    }
+  }
+
+  free_slots(t->slots, SLOT_COUNT);
+  return NULL;
+}
+
+
+// single producer single consumer queue of blocks
+struct queue_t
+{
+  _Atomic size_t head;
+  _Atomic size_t tail;
+  void*          blocks[QUEUE_SIZE];
+
+  // set by the producer once it has made all its blocks
+  atomic_int     done;
+};
+
+static int queue_push(struct queue_t* q, void* block)
+{
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  if (tail - atomic_load_explicit(&q->head, memory_order_acquire) == QUEUE_SIZE)
+    return 0;
+
+  q->blocks[tail % QUEUE_SIZE] = block;
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+  return 1;
+}
+
+static void* queue_pop(struct queue_t* q)
+{
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  if (head == atomic_load_explicit(&q->tail, memory_order_acquire))
+    return NULL;
+
+  void* block = q->blocks[head % QUEUE_SIZE];
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+  return block;
+}
+
+
+// each thread allocates blocks and hands them to the next thread,
+// which frees them, so every block is freed by a different thread
+// to the one that allocated it (unless there's only one thread)
+static void* producer_consumer(void* arg)
+{
+  struct thread_t* t = arg;
+  struct queue_t* in = &run.queues[t->id];
+  struct queue_t* out = &run.queues[(t->id + 1) % run.threads];
+  size_t produced = 0;
+  void* pending = NULL;
+
+  for (;;)
+  {
+    // produce, a failed allocation still counts
+    if (produced < run.ops / 2)
+    {
+      if (!pending)
+      {
+        timed_allocate(t, &pending, random_range(&t->random, 16, 512));
+        if (!pending)
+          produced++;
+      }
+
+      if (pending && queue_push(out, pending))
+      {
+        pending = NULL;
+        produced++;
+      }
+
+      if (produced == run.ops / 2)
+        atomic_store(&out->done, 1);
+    }
+
+    // consume
+    void* block = queue_pop(in);
+    if (block)
+      timed_deallocate(t, &block);
+    else if (atomic_load(&in->done) && produced == run.ops / 2)
+    {
+      // the producer might have pushed its last block
+      // between the pop and reading done
+      while ((block = queue_pop(in)))
+        timed_deallocate(t, &block);
+      break;
+    }
+    else if (produced == run.ops / 2)
+      sched_yield();
+  }
+
+  return NULL;
+}
+
+
+// larson-style churn, threads replace random blocks, and every
+// round each thread passes all its blocks on to the next thread
+static void* larson(void* arg)
+{
+  struct thread_t* t = arg;
+  size_t per_round = run.ops / LARSON_ROUNDS;
+
+  for (unsigned round = 0; round < LARSON_ROUNDS; round++)
+  {
+    void** slots = &run.larson_slots[((t->id + round) % run.threads) * SLOT_COUNT];
+
+    for (size_t i = 0; i < per_round; i += 2)
+    {
+      void** slot = &slots[random_range(&t->random, 0, SLOT_COUNT - 1)];
+
+      if (*slot)
+        timed_deallocate(t, slot);
+      timed_allocate(t, slot, random_range(&t->random, 16, 1024));
+    }
+
+    pthread_barrier_wait(&run.barrier);
+  }
+
+  // whatever is left is freed once every thread has finished
+  return NULL;
+}
+
+
+struct workload_t
+{
+  const char* name;
+  void*       (*function)(void*);
+};
+
+static const struct workload_t workloads[] =
+{
+  { "uniform",   uniform_small     },
+  { "lognormal", log_normal        },
+  { "prodcons",  producer_consumer },
+  { "larson",    larson            },
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+
+/*...........................................................................*/
+/*..                          RUNNING                                      ..*/
+/*...........................................................................*/
+
+
+static int compare_latencies(const void* a, const void* b)
+{
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+static uint32_t percentile(uint32_t* sorted, size_t count, double p)
+{
+  if (!count)
+    return 0;
+  size_t i = (size_t)(p * (count - 1));
+  return sorted[i];
+}
+
+static void run_benchmark(const struct workload_t* workload,
+                          const struct allocator_t* allocator,
+                          const struct lock_policy_t* lock,
+                          unsigned threads, size_t ops, uint64_t seed,
+                          size_t heap_size, unsigned arenas)
+{
+  void* memory = NULL;
+
+  bench_heap = NULL;
+  if (allocator->algorithm)
+  {
+    heap_options_t options = { .algorithm = allocator->algorithm, .arenas = arenas,
+      .lock_policy = lock->policy };
+
+    memory = malloc(heap_size);
+    assert(memory);
+    bench_heap = heap_create_with(memory, heap_size, &options);
+  }
+
+  memset(&run, 0, sizeof(run));
+  run.threads = threads;
+  run.ops = ops;
+  run.thread = calloc(threads, sizeof(struct thread_t));
+  run.queues = calloc(threads, sizeof(struct queue_t));
+  run.larson_slots = calloc((size_t)threads * SLOT_COUNT, sizeof(void*));
+  assert(run.thread && run.queues && run.larson_slots);
+  pthread_barrier_init(&run.barrier, NULL, threads);
+
+  for (unsigned i = 0; i < threads; i++)
+  {
+    struct thread_t* t = &run.thread[i];
+    t->id = i;
+    t->random = random_seed(seed, i);
+    t->capacity = ops + ops / LARSON_ROUNDS;
+    t->latencies = malloc(t->capacity * sizeof(uint32_t));
+    assert(t->latencies);
+  }
+
+  uint64_t start = now_ns();
+
+  for (unsigned i = 0; i < threads; i++)
+    pthread_create(&run.thread[i].thread, NULL, workload->function, &run.thread[i]);
+
+  for (unsigned i = 0; i < threads; i++)
+    pthread_join(run.thread[i].thread, NULL);
+
+  uint64_t elapsed = now_ns() - start;
+
+  free_slots(run.larson_slots, (size_t)threads * SLOT_COUNT);
+
+  // put every thread's latencies together
+  size_t total_ops = 0;
+  size_t samples = 0;
+  size_t failed = 0;
+  for (unsigned i = 0; i < threads; i++)
+  {
+    total_ops += run.thread[i].ops;
+    failed += run.thread[i].failed;
+    samples += run.thread[i].ops < run.thread[i].capacity ? run.thread[i].ops : run.thread[i].capacity;
+  }
+
+  uint32_t* latencies = malloc((samples ? samples : 1) * sizeof(uint32_t));
+  assert(latencies);
+
+  size_t n = 0;
+  for (unsigned i = 0; i < threads; i++)
+  {
+    struct thread_t* t = &run.thread[i];
+    size_t count = t->ops < t->capacity ? t->ops : t->capacity;
+    memcpy(latencies + n, t->latencies, count * sizeof(uint32_t));
+    n += count;
+    free(t->latencies);
+  }
+
+  qsort(latencies, samples, sizeof(uint32_t), compare_latencies);
+
+  printf("%-10s %-14s %-8s %7u %14.0f %8u %8u %8u ",
+         workload->name, allocator->name, bench_heap ? lock->name : "-", threads,
+         total_ops / (elapsed / 1e9),
+         percentile(latencies, samples, 0.50),
+         percentile(latencies, samples, 0.99),
+         percentile(latencies, samples, 0.999));
+
+  if (bench_heap)
+  {
+    heap_stats_t stats;
+    heap_get_stats(bench_heap, &stats);
+    printf("%9.1f%% %8zu %10llu\n", run.peak_fragmentation * 100.0, failed, stats.lock_waits);
+  }
+  else
+    printf("%10s %8zu %10s\n", "-", failed, "-");
+
+  free(latencies);
+  pthread_barrier_destroy(&run.barrier);
+  free(run.larson_slots);
+  free(run.queues);
+  free(run.thread);
+
+  if (bench_heap)
+  {
+    heap_validate(bench_heap);
+    heap_destroy(bench_heap);
+    free(memory);
+  }
+}
+
+
+static void print_usage(const char* program)
+{
+  printf("usage: %s [options]\n", program);
+  printf("  --threads N     run at 1, 2, 4 ... N threads (default %d)\n", DEFAULT_THREADS);
+  printf("  --ops N         operations per thread (default %d)\n", DEFAULT_OPS);
+  printf("  --seed N        random seed (default %d)\n", DEFAULT_SEED);
+  printf("  --heap-mb N     size of each heap in MB (default %d)\n", DEFAULT_HEAP_MB);
+  printf("  --arenas N      arenas per heap (default 1)\n");
+  printf("  --workload W    only run one workload:");
+  for (size_t i = 0; i < WORKLOAD_COUNT; i++)
+    printf(" %s", workloads[i].name);
+  printf("\n  --algorithm A   only run one allocator:");
+  for (size_t i = 0; i < ALLOCATOR_COUNT; i++)
+    printf(" %s", allocators[i].name);
+  printf("\n  --lock L        arena lock (default mutex), or all:");
+  for (size_t i = 0; i < LOCK_POLICY_COUNT; i++)
+    printf(" %s", lock_policies[i].name);
+  printf("\n");
+}
+
+
+int main(int argc, char** argv)
+{
+  unsigned max_threads = DEFAULT_THREADS;
+  size_t ops = DEFAULT_OPS;
+  uint64_t seed = DEFAULT_SEED;
+  size_t heap_mb = DEFAULT_HEAP_MB;
+  unsigned arenas = 1;
+  const char* only_workload = NULL;
+  const char* only_allocator = NULL;
+  const char* only_lock = lock_policies[0].name;
+
+  for (int i = 1; i < argc; i++)
+  {
+    const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+    if (!strcmp(argv[i], "--threads") && value)
+      max_threads = (unsigned)strtoul(value, NULL, 10);
+    else if (!strcmp(argv[i], "--ops") && value)
+      ops = strtoull(value, NULL, 10);
+    else if (!strcmp(argv[i], "--seed") && value)
+      seed = strtoull(value, NULL, 10);
+    else if (!strcmp(argv[i], "--heap-mb") && value)
+      heap_mb = strtoull(value, NULL, 10);
+    else if (!strcmp(argv[i], "--arenas") && value)
+      arenas = (unsigned)strtoul(value, NULL, 10);
+    else if (!strcmp(argv[i], "--workload") && value)
+      only_workload = value;
+    else if (!strcmp(argv[i], "--algorithm") && value)
+      only_allocator = value;
+    else if (!strcmp(argv[i], "--lock") && value)
+      only_lock = strcmp(value, "all") ? value : NULL;
+    else
+    {
+      print_usage(argv[0]);
+      return strcmp(argv[i], "--help") ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    i++;
+  }
+
+  if (max_threads == 0 || ops < LARSON_ROUNDS * 2 || heap_mb == 0)
+  {
+    fprintf(stderr, "Error : threads, ops and heap size must be positive\n");
+    return EXIT_FAILURE;
+  }
+
+  size_t lock = 0;
+  while (only_lock && lock < LOCK_POLICY_COUNT && strcmp(only_lock, lock_policies[lock].name))
+    lock++;
+
+  if (lock == LOCK_POLICY_COUNT)
+  {
+    fprintf(stderr, "Error : unknown lock %s\n", only_lock);
+    return EXIT_FAILURE;
+  }
+
+  printf("%-10s %-14s %-8s %7s %14s %8s %8s %8s %10s %8s %10s\n",
+         "workload", "allocator", "lock", "threads", "ops/sec",
+         "p50 ns", "p99 ns", "p999 ns", "peak frag", "failed", "lock waits");
+
+  for (size_t w = 0; w < WORKLOAD_COUNT; w++)
+  {
+    if (only_workload && strcmp(only_workload, workloads[w].name))
+      continue;
+
+    for (size_t a = 0; a < ALLOCATOR_COUNT; a++)
+    {
+      if (only_allocator && strcmp(only_allocator, allocators[a].name))
+        continue;
+
+      for (size_t l = 0; l < LOCK_POLICY_COUNT; l++)
+      {
+        if (only_lock && strcmp(only_lock, lock_policies[l].name))
+          continue;
+
+        for (unsigned threads = 1; ; threads *= 2)
+        {
+          if (threads > max_threads)
+            threads = max_threads;
+
+          run_benchmark(&workloads[w], &allocators[a], &lock_policies[l], threads, ops, seed,
+                        heap_mb << 20, arenas);
+
+          if (threads == max_threads)
+            break;
+        }
+
+        // malloc has its own locks
+        if (allocators[a].algorithm == NULL)
+          break;
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
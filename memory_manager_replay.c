@@ -0,0 +1,354 @@
+/*
+*----------------------------------------------------------------------------*
+*  memory_manager_replay.c                                                   *
+*                                                                            *
+*  Description: Replays a trace recorded with trace_start() against each     *
+*               allocation algorithm and reports how long it took, how       *
+*               many allocations failed and how fragmented the heap got.     *
+*                                                                            *
+*               Records are replayed one after another on a single thread,   *
+*               in the order they were recorded, so every run of the same    *
+*               trace does exactly the same thing.                           *
+*                                                                            *
+*               MINIMUM_FREE_BLOCK can be tuned by building with e.g.        *
+*               -DMINIMUM_FREE_BLOCK=64 and replaying the same trace.        *
+*----------------------------------------------------------------------------*
+*/
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "memory_manager.h"
+#include "memory_trace.h"
+
+
+#define DEFAULT_HEAP_MB 64
+
+// fragmentation is measured every this many records
+#define USAGE_INTERVAL 4096
+
+
+static const char* algorithms[] =
+{
+  FIRSTFIT, NEXTFIT, BESTFIT, WORSTFIT, SEGREGATEDFIT, BUDDY
+};
+
+#define ALGORITHM_COUNT (sizeof(algorithms) / sizeof(algorithms[0]))
+
+
+static uint64_t now_ns()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+
+/*...........................................................................*/
+/*..                          BLOCK MAP                                    ..*/
+/*...........................................................................*/
+
+
+// maps the address a block had when it was traced to
+// the memory it has in the replay, using linear probing
+struct block_map_t
+{
+  uint64_t* keys;
+  void**    values;
+  size_t    mask;
+};
+
+static size_t map_slot(struct block_map_t* map, uint64_t key)
+{
+  size_t i = (size_t)((key >> 4) * 0x9E3779B97F4A7C15ULL) & map->mask;
+  while (map->keys[i] && map->keys[i] != key)
+    i = (i + 1) & map->mask;
+  return i;
+}
+
+static void map_put(struct block_map_t* map, uint64_t key, void* value)
+{
+  size_t i = map_slot(map, key);
+  map->keys[i] = key;
+  map->values[i] = value;
+}
+
+// removes a block, returning its memory or NULL if it isn't there
+static void* map_take(struct block_map_t* map, uint64_t key)
+{
+  size_t i = map_slot(map, key);
+  if (map->keys[i] == 0)
+    return NULL;
+
+  void* value = map->values[i];
+  map->keys[i] = 0;
+
+  // move anything after it that would no longer be found
+  size_t j = i;
+  for (;;)
+  {
+    j = (j + 1) & map->mask;
+    if (map->keys[j] == 0)
+      break;
+
+    size_t home = map_slot(map, map->keys[j]);
+    if (home != j)
+    {
+      map->keys[i] = map->keys[j];
+      map->values[i] = map->values[j];
+      map->keys[j] = 0;
+      i = j;
+    }
+  }
+
+  return value;
+}
+
+
+/*...........................................................................*/
+/*..                          REPLAY                                       ..*/
+/*...........................................................................*/
+
+
+struct result_t
+{
+  uint64_t time;
+  size_t   failed;
+  size_t   peak_used;
+  double   peak_fragmentation;
+};
+
+static void measure_usage(heap_t* heap, struct result_t* result)
+{
+  heap_usage_t usage;
+  heap_get_usage(heap, &usage);
+
+  if (usage.used_bytes > result->peak_used)
+    result->peak_used = usage.used_bytes;
+
+  if (usage.free_bytes)
+  {
+    double fragmentation = 1.0 - (double)usage.largest_free / usage.free_bytes;
+    if (fragmentation > result->peak_fragmentation)
+      result->peak_fragmentation = fragmentation;
+  }
+}
+
+
+// replays every record against a heap
+static void replay(heap_t* heap, const trace_record_t* records, size_t count,
+                   struct block_map_t* map, struct result_t* result)
+{
+  memset(result, 0, sizeof(*result));
+
+  for (size_t i = 0; i < count; i++)
+  {
+    const trace_record_t* r = &records[i];
+    uint64_t start = now_ns();
+    void* memory = NULL;
+
+    switch (r->op)
+    {
+      case TRACE_ALLOCATE:
+      case TRACE_ALLOCATE_UNINITIALISED:
+      case TRACE_ALLOCATE_ALIGNED:
+        // it failed when it was traced, so there's nothing to replay
+        if (r->block == 0)
+          break;
+
+        if (r->op == TRACE_ALLOCATE)
+          memory = heap_allocate(heap, r->size);
+        else if (r->op == TRACE_ALLOCATE_UNINITIALISED)
+          memory = heap_allocate_uninitialised(heap, r->size);
+        else
+          memory = heap_allocate_aligned(heap, (size_t)1 << r->alignment_log2, r->size);
+
+        if (memory)
+          map_put(map, r->block, memory);
+        else
+          result->failed++;
+        break;
+
+      case TRACE_DEALLOCATE:
+        heap_deallocate(heap, map_take(map, r->block));
+        break;
+
+      case TRACE_REALLOCATE:
+      {
+        // failed when traced, the old block was left as it was
+        if (r->size && r->block == 0)
+          break;
+
+        void* old = r->old_block ? map_take(map, r->old_block) : NULL;
+
+        // the old block didn't make it into the replay
+        if (r->old_block && old == NULL)
+        {
+          if (r->size)
+            result->failed++;
+          break;
+        }
+
+        memory = heap_reallocate(heap, old, r->size);
+
+        if (memory)
+          map_put(map, r->block, memory);
+        else if (r->size)
+        {
+          heap_deallocate(heap, old);
+          result->failed++;
+        }
+        break;
+      }
+
+      default:
+        fprintf(stderr, "Error : unknown trace record %u\n", r->op);
+        exit(EXIT_FAILURE);
+    }
+
+    result->time += now_ns() - start;
+
+    if (i % USAGE_INTERVAL == 0)
+      measure_usage(heap, result);
+  }
+
+  measure_usage(heap, result);
+
+  // free whatever the trace left allocated
+  for (size_t i = 0; i <= map->mask; i++)
+  {
+    if (map->keys[i])
+      heap_deallocate(heap, map->values[i]);
+    map->keys[i] = 0;
+  }
+}
+
+
+// reads a whole trace file into memory
+static trace_record_t* load_trace(const char* path, size_t* count)
+{
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+  {
+    fprintf(stderr, "Error : cannot open trace file %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  char magic[sizeof(TRACE_MAGIC)] = { 0 };
+  if (fread(magic, 1, strlen(TRACE_MAGIC), file) != strlen(TRACE_MAGIC) ||
+      strcmp(magic, TRACE_MAGIC))
+  {
+    fprintf(stderr, "Error : %s is not a trace file\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  size_t capacity = 4096;
+  trace_record_t* records = malloc(capacity * sizeof(trace_record_t));
+  *count = 0;
+
+  for (;;)
+  {
+    if (*count == capacity)
+    {
+      capacity *= 2;
+      records = realloc(records, capacity * sizeof(trace_record_t));
+    }
+    assert(records);
+
+    size_t read = fread(records + *count, sizeof(trace_record_t), capacity - *count, file);
+    if (read == 0)
+      break;
+    *count += read;
+  }
+
+  fclose(file);
+  return records;
+}
+
+
+int main(int argc, char** argv)
+{
+  const char* path = NULL;
+  const char* only_algorithm = NULL;
+  size_t heap_mb = DEFAULT_HEAP_MB;
+  unsigned arenas = 1;
+  int bad = 0;
+
+  for (int i = 1; i < argc && !bad; i++)
+  {
+    const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+    if (!strcmp(argv[i], "--algorithm") && value)
+      only_algorithm = argv[++i];
+    else if (!strcmp(argv[i], "--heap-mb") && value)
+      heap_mb = strtoull(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "--arenas") && value)
+      arenas = (unsigned)strtoul(argv[++i], NULL, 10);
+    else if (argv[i][0] != '-' && path == NULL)
+      path = argv[i];
+    else
+      bad = 1;
+  }
+
+  if (bad || path == NULL || heap_mb == 0)
+  {
+    printf("usage: %s trace-file [--algorithm A] [--heap-mb N] [--arenas N]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  size_t count;
+  trace_record_t* records = load_trace(path, &count);
+
+  // no more blocks than records can be live at once
+  struct block_map_t map;
+  size_t slots = 16;
+  while (slots < 2 * count)
+    slots *= 2;
+  map.mask = slots - 1;
+  map.keys = calloc(slots, sizeof(uint64_t));
+  map.values = calloc(slots, sizeof(void*));
+  assert(map.keys && map.values);
+
+#ifdef MINIMUM_FREE_BLOCK
+  printf("%zu records, MINIMUM_FREE_BLOCK %d\n", count, MINIMUM_FREE_BLOCK);
+#else
+  printf("%zu records\n", count);
+#endif
+  printf("%-14s %12s %10s %8s %14s %10s\n",
+         "algorithm", "time ms", "ns/op", "failed", "peak used", "peak frag");
+
+  size_t heap_size = heap_mb << 20;
+  void* memory = malloc(heap_size);
+  assert(memory);
+
+  for (size_t a = 0; a < ALGORITHM_COUNT; a++)
+  {
+    if (only_algorithm && strcmp(only_algorithm, algorithms[a]))
+      continue;
+
+    heap_options_t options = { .algorithm = (char*)algorithms[a], .arenas = arenas };
+    heap_t* heap = heap_create_with(memory, heap_size, &options);
+
+    struct result_t result;
+    replay(heap, records, count, &map, &result);
+
+    printf("%-14s %12.3f %10.1f %8zu %14zu %9.1f%%\n",
+           algorithms[a], result.time / 1e6,
+           count ? (double)result.time / count : 0.0,
+           result.failed, result.peak_used, result.peak_fragmentation * 100.0);
+
+    heap_validate(heap);
+    heap_destroy(heap);
+  }
+
+  free(memory);
+  free(map.keys);
+  free(map.values);
+  free(records);
+  return EXIT_SUCCESS;
+}
@@ -25,8 +25,14 @@
 #include <assert.h>
 #include <memory.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "memory_manager.h"
+#include "memory_pool.h"
+
+#ifdef MM_TRACE
+  #include "memory_trace.h"
+#endif
 
 
 // allocate the memory for the allocater
@@ -202,9 +208,45 @@ static void test_next_fit()
 /*------------------------------------------------------*/
 
 
+// leaves free holes of these sizes, each between two allocated
+// blocks, too big for the thread cache
+static const size_t hole_sizes[] = { 900, 600, 1100, 700 };
+#define HOLES (sizeof(hole_sizes) / sizeof(hole_sizes[0]))
+
+static heap_t* make_holes(char* algorithm, uint8_t* holes[], uint8_t** end)
+{
+  heap_t* heap = heap_create(memory_buffer, MEMORY_SIZE, algorithm);
+
+  assert(heap_allocate(heap, 520));
+  for (size_t i = 0; i < HOLES; i++)
+  {
+    holes[i] = heap_allocate(heap, hole_sizes[i]);
+    *end = heap_allocate(heap, 520);
+    assert(holes[i] && *end);
+  }
+
+  for (size_t i = 0; i < HOLES; i++)
+    heap_deallocate(heap, holes[i]);
+  heap_validate(heap);
+  return heap;
+}
+
 static void test_best_fit()
 {
   printf("BESTFIT TEST\n");
+
+  // the smallest hole that fits, whatever order they're in
+  printf("[*] Checking the best hole is chosen...\n");
+  uint8_t* holes[HOLES];
+  uint8_t* end;
+  heap_t* heap = make_holes(BESTFIT, holes, &end);
+  assert(heap_allocate(heap, 650) == holes[3]);
+  assert(heap_allocate(heap, 550) == holes[1]);
+  assert(heap_allocate(heap, 800) == holes[0]);
+  assert(heap_allocate(heap, 800) == holes[2]);
+  heap_validate(heap);
+  heap_destroy(heap);
+
   for(int i = 0; i < 5; i ++)
   {
     printf("[*] Running soak & merg tests on %d threads...\n",THREAD_NUMBER);
@@ -228,6 +270,18 @@ static void test_best_fit()
 static void test_worst_fit()
 {
   printf("WORSTFIT TEST\n");
+
+  // the rest of the heap is bigger than any hole
+  printf("[*] Checking the biggest hole is chosen...\n");
+  uint8_t* holes[HOLES];
+  uint8_t* end;
+  heap_t* heap = make_holes(WORSTFIT, holes, &end);
+  assert((uint8_t*)heap_allocate(heap, 1000) > end);
+  assert(heap_allocate(heap, 1000) == holes[2]);
+  assert(heap_allocate(heap, 550) == holes[0]);
+  heap_validate(heap);
+  heap_destroy(heap);
+
   for(int i = 0; i < 5; i ++)
   {
     printf("[*] Running soak & merg tests on %d threads...\n",THREAD_NUMBER);
@@ -249,10 +303,1292 @@ static void test_worst_fit()
 /*------------------------------------------------------*/
 
 
+static void test_segregated_fit()
+{
+  printf("SEGREGATEDFIT TEST\n");
+  for(int i = 0; i < 5; i ++)
+  {
+    printf("[*] Running soak & merg tests on %d threads...\n",THREAD_NUMBER);
+    initialise(memory_buffer, MEMORY_SIZE, SEGREGATEDFIT);
+    start_test_threads();
+    printf("[!] SOAK & MERG TESTS PASSED\n");
+
+    // validate our memory manager
+    validate();
+  }
+  
+  // we should now be left with one free node
+  print_all_nodes();
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+// lining up the arena can take most of a page, so it has to be
+// big enough for a couple of 2048 byte blocks whatever its address
+#define BUDDY_MEMORY_SIZE 16384
+static uint8_t buddy_buffer[BUDDY_MEMORY_SIZE];
+
+static void test_buddy()
+{
+  printf("BUDDY TEST\n");
+
+  // blocks are split in half down to the size needed, and
+  // their memory is aligned to the block's size
+  printf("[*] Checking blocks split and merge...\n");
+  heap_t* heap = heap_create(buddy_buffer, BUDDY_MEMORY_SIZE, BUDDY);
+  heap_usage_t before, after;
+  heap_get_usage(heap, &before);
+
+  uint8_t* a = heap_allocate(heap, 1000);
+  uint8_t* b = heap_allocate(heap, 1000);
+  assert(a && b && (uintptr_t)a % 1024 == 0 && (uintptr_t)b % 1024 == 0);
+
+  // a's buddy is in use until b is freed, then they merge back
+  heap_deallocate(heap, a);
+  heap_validate(heap);
+  heap_deallocate(heap, b);
+  heap_get_usage(heap, &after);
+  assert(after.free_blocks == before.free_blocks);
+  assert(after.largest_free == before.largest_free);
+
+  // shrinking frees the top half, which growing can take back
+  a = heap_allocate(heap, 2000);
+  assert(a && (uintptr_t)a % 2048 == 0);
+  assert(heap_reallocate(heap, a, 600) == a);
+  heap_validate(heap);
+  assert(heap_reallocate(heap, a, 1500) == a);
+  heap_deallocate(heap, a);
+  heap_validate(heap);
+  heap_destroy(heap);
+
+  for(int i = 0; i < 5; i ++)
+  {
+    printf("[*] Running soak & merg tests on %d threads...\n",THREAD_NUMBER);
+    initialise(memory_buffer, MEMORY_SIZE, BUDDY);
+    start_test_threads();
+    printf("[!] SOAK & MERG TESTS PASSED\n");
+
+    // validate our memory manager
+    validate();
+  }
+
+  print_all_nodes();
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+// a block freed by a thread should be handed straight back to it
+static void* cache_test(void* arg)
+{
+  void* a = allocate(64);
+  assert(a);
+  deallocate(a);
+
+  void* b = allocate(64);
+  assert(b == a);
+
+  // it has to be zeroed like any other allocation
+  for (int n = 0; n < 64; n++)
+    assert(((uint8_t*)b)[n] == 0);
+
+  memset(b, 0xff, 64);
+  deallocate(b);
+
+  // unless we ask for it not to be, the cache
+  // only overwrites the start of the block
+  void* c = allocate_uninitialised(64);
+  assert(c == b);
+  for (int n = 2 * sizeof(void*); n < 64; n++)
+    assert(((uint8_t*)c)[n] == 0xff);
+
+  deallocate(c);
+  return NULL;
+}
+
+
+/*------------------------------------------------------*/
+
+
+static void test_thread_cache()
+{
+  printf("THREAD CACHE TEST\n");
+  initialise(memory_buffer, MEMORY_SIZE, FIRSTFIT);
+
+  printf("[*] Running cache test on a single thread...\n");
+  pthread_t tid;
+  pthread_create(&tid, NULL, &cache_test, NULL);
+  pthread_join(tid, NULL);
+  printf("[!] CACHE TEST PASSED\n");
+
+  // the thread's cache is flushed when it exits
+  validate();
+  print_all_nodes();
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+// each thread gets its own heap, they shouldn't affect each other
+static void* heap_test(void* arg)
+{
+  uint8_t* memory = arg;
+  heap_t* heap = heap_create(memory, MEMORY_SIZE, BESTFIT);
+  void* blocks[64];
+
+  for (int n = 0; n < 64; n++)
+  {
+    blocks[n] = heap_allocate(heap, random_num(1, 256));
+    if (blocks[n])
+      memset(blocks[n], n, 1);
+  }
+  heap_validate(heap);
+
+  for (int n = 0; n < 64; n++)
+  {
+    // everything we got should be inside our own memory
+    assert(blocks[n] == NULL ||
+      ((uint8_t*)blocks[n] > memory && (uint8_t*)blocks[n] < memory + MEMORY_SIZE));
+    heap_deallocate(heap, blocks[n]);
+  }
+  heap_validate(heap);
+
+  heap_destroy(heap);
+  return NULL;
+}
+
+
+/*------------------------------------------------------*/
+
+
+#define HEAP_NUMBER 8
+static uint8_t heap_buffers[HEAP_NUMBER][MEMORY_SIZE];
+
+static void test_heaps()
+{
+  printf("HEAP TEST\n");
+  printf("[*] Running heap tests on %d threads...\n", HEAP_NUMBER);
+
+  pthread_t tid[HEAP_NUMBER];
+  for (int i = 0; i < HEAP_NUMBER; i++)
+    pthread_create(&tid[i], NULL, &heap_test, heap_buffers[i]);
+
+  for (int i = 0; i < HEAP_NUMBER; i++)
+    pthread_join(tid[i], NULL);
+
+  printf("[!] HEAP TESTS PASSED\n");
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+// arenas keep their bookkeeping in the heap's memory, so give them more
+#define ARENA_MEMORY_SIZE 65536
+static uint8_t arena_buffer[ARENA_MEMORY_SIZE];
+
+static void test_arenas()
+{
+  printf("ARENA TEST\n");
+  for(int i = 0; i < 5; i ++)
+  {
+    printf("[*] Running soak & merg tests on %d threads with 4 arenas...\n",THREAD_NUMBER);
+    heap_options_t options = { .algorithm = FIRSTFIT, .arenas = 4,
+      .arena_policy = i % 2 ? ARENA_BY_CPU : ARENA_ROUND_ROBIN };
+    initialise_with(arena_buffer, ARENA_MEMORY_SIZE, &options);
+    start_test_threads();
+    printf("[!] SOAK & MERG TESTS PASSED\n");
+
+    // validate our memory manager
+    validate();
+  }
+
+  // every arena should now be one free node
+  print_all_nodes();
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+// blocks should grow and shrink in place when they can
+static void test_reallocate()
+{
+  printf("REALLOCATE TEST\n");
+  printf("[*] Running reallocate tests...\n");
+
+  // big enough that freed blocks aren't kept in the thread cache
+  heap_t* heap = heap_create(memory_buffer, MEMORY_SIZE, FIRSTFIT);
+  uint8_t* a = heap_allocate(heap, 1000);
+  uint8_t* b = heap_allocate(heap, 1000);
+  memset(a, 0xaa, 1000);
+
+  // shrinking stays where it is
+  assert(heap_reallocate(heap, a, 600) == a);
+  heap_validate(heap);
+
+  // c is last, so it can grow into the free memory after it
+  uint8_t* c = heap_allocate(heap, 1000);
+  assert(heap_reallocate(heap, c, 1200) == c);
+  heap_validate(heap);
+
+  // b can't grow in place, c is in the way
+  uint8_t* moved = heap_reallocate(heap, b, 2000);
+  assert(moved && moved != b);
+  heap_validate(heap);
+
+  // now b has gone, a can grow into its space
+  assert(heap_reallocate(heap, a, 1600) == a);
+  for (int n = 0; n < 600; n++)
+    assert(a[n] == 0xaa);
+  heap_validate(heap);
+
+  heap_deallocate(heap, a);
+  heap_deallocate(heap, c);
+  heap_deallocate(heap, moved);
+  heap_validate(heap);
+  heap_print_all_nodes(heap);
+  heap_destroy(heap);
+
+  printf("[!] REALLOCATE TESTS PASSED\n");
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+// aligned blocks should work with every algorithm
+static void test_aligned()
+{
+  printf("ALIGNED TEST\n");
+  char* algorithms[] = { FIRSTFIT, NEXTFIT, BESTFIT, WORSTFIT, SEGREGATEDFIT, BUDDY };
+
+  for (int i = 0; i < 6; i++)
+  {
+    printf("[*] Running aligned tests with %s...\n", algorithms[i]);
+    heap_t* heap = heap_create(memory_buffer, MEMORY_SIZE, algorithms[i]);
+    void* blocks[24];
+
+    for (int n = 0; n < 24; n++)
+    {
+      // 16 up to 4096
+      size_t alignment = (size_t)16 << (n % 9);
+      blocks[n] = heap_allocate_aligned(heap, alignment, random_num(1, 200));
+
+      if (blocks[n])
+        assert((uintptr_t)blocks[n] % alignment == 0);
+      heap_validate(heap);
+    }
+
+    // mix in some normal blocks and free every other one
+    for (int n = 0; n < 24; n += 2)
+    {
+      heap_deallocate(heap, blocks[n]);
+      blocks[n] = heap_allocate(heap, random_num(1, 200));
+    }
+    heap_validate(heap);
+
+    for (int n = 0; n < 24; n++)
+      heap_deallocate(heap, blocks[n]);
+    heap_validate(heap);
+    heap_destroy(heap);
+  }
+
+  printf("[!] ALIGNED TESTS PASSED\n");
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+// this tests batches of blocks, a whole batch should
+// go back to one free node when it is freed
+static void batch_test()
+{
+  void* blocks[NUMBER_OF_BLOCKS / 10];
+  size_t count = NUMBER_OF_BLOCKS / 10;
+
+  for (int i = 0; i < 10; i++)
+  {
+    size_t got = allocate_batch(count, random_num(1, 64), blocks);
+    for (size_t n = got; n < count; n++)
+      assert(blocks[n] == NULL);
+
+    deallocate_batch(blocks, count);
+  }
+}
+
+
+static void* run_batch_tests(void* arg)
+{
+  batch_test();
+  return NULL;
+}
+
+
+static void test_batches()
+{
+  printf("BATCH TEST\n");
+  char* algorithms[] = { FIRSTFIT, NEXTFIT, BESTFIT, WORSTFIT, SEGREGATEDFIT, BUDDY };
+
+  for (int i = 0; i < 6; i++)
+  {
+    printf("[*] Running batch tests with %s on %d threads...\n", algorithms[i], HEAP_NUMBER);
+    initialise(memory_buffer, MEMORY_SIZE, algorithms[i]);
+
+    pthread_t tid[HEAP_NUMBER];
+    for (int t = 0; t < HEAP_NUMBER; t++)
+      pthread_create(&tid[t], NULL, &run_batch_tests, NULL);
+
+    for (int t = 0; t < HEAP_NUMBER; t++)
+      pthread_join(tid[t], NULL);
+
+    validate();
+  }
+  printf("[!] BATCH TESTS PASSED\n");
+
+  // batches skip the thread cache so we should have one free node
+  print_all_nodes();
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+#define POOL_OBJECTS 200
+static pool_t* pool;
+
+// every thread can hold all of its objects at once, so the pool
+// needs slabs of 16 up to 1024 objects, 2032 in all, and more
+// than the 64KB the other tests use
+#define POOL_MEMORY_SIZE 131072
+static uint8_t pool_buffer[POOL_MEMORY_SIZE];
+
+// threads take objects from a shared pool, no two threads
+// should ever be given the same object
+static void* pool_test(void* arg)
+{
+  uint8_t* objects[POOL_OBJECTS];
+  uint8_t  marker = (uint8_t)(uintptr_t)arg;
+
+  for (int i = 0; i < 50; i++)
+  {
+    for (int n = 0; n < POOL_OBJECTS; n++)
+    {
+      objects[n] = pool_allocate(pool);
+      assert(objects[n]);
+      memset(objects[n], marker, 24);
+    }
+
+    for (int n = 0; n < POOL_OBJECTS; n++)
+    {
+      for (int b = 0; b < 24; b++)
+        assert(objects[n][b] == marker);
+      pool_deallocate(pool, objects[n]);
+    }
+  }
+  return NULL;
+}
+
+
+/*------------------------------------------------------*/
+
+
+static void test_pool()
+{
+  printf("POOL TEST\n");
+  initialise(pool_buffer, POOL_MEMORY_SIZE, FIRSTFIT);
+  pool = pool_create(NULL, 24, 16);
+  assert(pool);
+
+  printf("[*] Running pool tests on %d threads...\n", HEAP_NUMBER);
+  pthread_t tid[HEAP_NUMBER];
+  for (int i = 0; i < HEAP_NUMBER; i++)
+    pthread_create(&tid[i], NULL, &pool_test, (void*)(uintptr_t)(i + 1));
+
+  for (int i = 0; i < HEAP_NUMBER; i++)
+    pthread_join(tid[i], NULL);
+
+  validate();
+  pool_destroy(pool);
+  validate();
+  printf("[!] POOL TESTS PASSED\n");
+  printf("========================\n");
+}
+
+
+#define STATS_BLOCKS 32
+
+// allocates blocks of different sizes, frees every other one
+// and keeps the rest, while another thread reads the statistics
+static void* stats_test(void* arg)
+{
+  void** blocks = arg;
+
+  for (int n = 0; n < STATS_BLOCKS; n++)
+    blocks[n] = allocate(16 + (n % 8) * 8);
+
+  for (int n = 0; n < STATS_BLOCKS; n += 2)
+    deallocate(blocks[n]);
+  return NULL;
+}
+
+
+/*------------------------------------------------------*/
+
+
+static void test_stats()
+{
+  printf("STATS TEST\n");
+  heap_options_t options = { .algorithm = BESTFIT, .arenas = 4 };
+  initialise_with(arena_buffer, ARENA_MEMORY_SIZE, &options);
+
+  printf("[*] Running stats tests on %d threads...\n", HEAP_NUMBER);
+  static void* blocks[HEAP_NUMBER][STATS_BLOCKS];
+  pthread_t tid[HEAP_NUMBER];
+  for (int i = 0; i < HEAP_NUMBER; i++)
+    pthread_create(&tid[i], NULL, &stats_test, blocks[i]);
+
+  // reading them while the threads run is always safe
+  heap_stats_t stats;
+  for (int i = 0; i < 100; i++)
+  {
+    get_stats(&stats);
+    assert(stats.used_bytes + stats.free_bytes <= stats.heap_size);
+  }
+
+  for (int i = 0; i < HEAP_NUMBER; i++)
+    pthread_join(tid[i], NULL);
+
+  // with nothing running they should match a walk of the heap
+  heap_usage_t usage;
+  get_stats(&stats);
+  get_usage(&usage);
+  assert(stats.heap_size == usage.heap_size);
+  assert(stats.used_bytes == usage.used_bytes);
+  assert(stats.free_bytes == usage.free_bytes);
+  assert(stats.free_blocks == usage.free_blocks);
+  assert(stats.largest_free == usage.largest_free);
+
+  assert(stats.allocations == HEAP_NUMBER * STATS_BLOCKS);
+  assert(stats.deallocations == HEAP_NUMBER * STATS_BLOCKS / 2);
+  assert(stats.failed_allocations == 0);
+
+  // something too big to fit is counted as failed
+  assert(allocate(ARENA_MEMORY_SIZE) == NULL);
+  get_stats(&stats);
+  assert(stats.failed_allocations == 1);
+
+  validate();
+  printf("[!] STATS TESTS PASSED\n");
+  printf("========================\n");
+}
+
+
+#define MAPPED_CHUNK  65536
+#define MAPPED_BLOCKS 512
+
+// allocates far more than a chunk then frees it all
+static void* mapped_test(void* arg)
+{
+  heap_t* heap = arg;
+  void* blocks[MAPPED_BLOCKS];
+
+  for (int n = 0; n < MAPPED_BLOCKS; n++)
+  {
+    blocks[n] = heap_allocate(heap, 1000 + n % 64);
+    assert(blocks[n]);
+  }
+
+  for (int n = 0; n < MAPPED_BLOCKS; n++)
+    heap_deallocate(heap, blocks[n]);
+  return NULL;
+}
+
+
+/*------------------------------------------------------*/
+
+
+static void test_mapped()
+{
+  printf("MAPPED HEAP TEST\n");
+  // big blocks come from the heap too, so it has to grow for them
+  heap_options_t options = { .algorithm = BESTFIT, .arenas = 2,
+                             .chunk_size = MAPPED_CHUNK, .spare_chunks = 1,
+                             .mmap_threshold = SIZE_MAX };
+  heap_t* heap = heap_create_mapped(64 << 20, &options);
+  assert(heap);
+
+  // only the first chunk of each arena is there to start with
+  heap_usage_t usage;
+  heap_get_usage(heap, &usage);
+  assert(usage.free_bytes <= 2 * MAPPED_CHUNK);
+
+  printf("[*] Growing on %d threads...\n", HEAP_NUMBER);
+  pthread_t tid[HEAP_NUMBER];
+  for (int i = 0; i < HEAP_NUMBER; i++)
+    pthread_create(&tid[i], NULL, &mapped_test, heap);
+
+  for (int i = 0; i < HEAP_NUMBER; i++)
+    pthread_join(tid[i], NULL);
+  heap_validate(heap);
+
+  // everything was freed, so all but a spare chunk or
+  // so of each arena should have been given back
+  heap_get_usage(heap, &usage);
+  assert(usage.used_bytes == 0);
+  assert(usage.free_bytes <= 2 * 2 * MAPPED_CHUNK);
+
+  printf("[*] Checking large and failed allocations...\n");
+  void* large = heap_allocate(heap, 5 * MAPPED_CHUNK);
+  assert(large);
+  assert(heap_allocate(heap, 128 << 20) == NULL);
+  heap_deallocate(heap, large);
+  heap_validate(heap);
+  heap_destroy(heap);
+
+  // the default heap can be mapped too
+  assert(initialise_mapped(16 << 20, &options) == 0);
+  void* memory = allocate(4 * MAPPED_CHUNK);
+  assert(memory);
+  deallocate(memory);
+  validate();
+
+  printf("[!] MAPPED HEAP TESTS PASSED\n");
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+static void test_large_blocks()
+{
+  printf("LARGE BLOCKS TEST\n");
+  heap_options_t options = { .algorithm = FIRSTFIT, .mmap_threshold = 8192 };
+  heap_t* heap = heap_create_with(arena_buffer, ARENA_MEMORY_SIZE, &options);
+
+  // far too big for the heap, but it gets a mapping of its own
+  printf("[*] Allocating large blocks...\n");
+  size_t size = 4 * ARENA_MEMORY_SIZE;
+  uint8_t* large = heap_allocate(heap, size);
+  assert(large);
+  assert((uintptr_t)large % 16 == 0);
+  for (size_t i = 0; i < size; i += 4096)
+    assert(large[i] == 0);
+  memset(large, 0xAB, size);
+
+  void* aligned = heap_allocate_aligned(heap, 4096, 10000);
+  assert(aligned && (uintptr_t)aligned % 4096 == 0);
+
+  heap_stats_t stats;
+  heap_get_stats(heap, &stats);
+  assert(stats.mapped_blocks == 2);
+  assert(stats.mapped_bytes >= size + 10000);
+  assert(stats.used_bytes == 0);
+
+  // shrinking keeps it where it is, growing moves it
+  printf("[*] Reallocating large blocks...\n");
+  assert(heap_reallocate(heap, large, size / 2) == large);
+  large = heap_reallocate(heap, large, size * 2);
+  assert(large);
+  for (size_t i = 0; i < size / 2; i++)
+    assert(large[i] == 0xAB);
+
+  // small enough to go back in the heap
+  large = heap_reallocate(heap, large, 100);
+  assert(large && large[99] == 0xAB);
+  heap_get_stats(heap, &stats);
+  assert(stats.mapped_blocks == 1);
+
+  heap_deallocate(heap, large);
+  heap_deallocate(heap, aligned);
+
+  // a batch of them each get their own
+  void* blocks[4];
+  assert(heap_allocate_batch(heap, 4, 10000, blocks) == 4);
+  heap_get_stats(heap, &stats);
+  assert(stats.mapped_blocks == 4);
+  heap_deallocate_batch(heap, blocks, 4);
+
+  heap_get_stats(heap, &stats);
+  assert(stats.mapped_blocks == 0 && stats.mapped_bytes == 0);
+  assert(stats.allocations == stats.deallocations);
+  heap_validate(heap);
+  heap_destroy(heap);
+
+  printf("[!] LARGE BLOCKS TESTS PASSED\n");
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+#define HUGE_PAGE (2 << 20)
+
+static void test_huge_pages()
+{
+  printf("HUGE PAGES TEST\n");
+  heap_options_t options = { .algorithm = SEGREGATEDFIT, .huge_pages = 1 };
+
+  // the arena starts on a huge page and commits whole ones
+  printf("[*] Checking a mapped heap...\n");
+  heap_t* heap = heap_create_mapped(64 << 20, &options);
+  assert(heap);
+
+  uint8_t* small = heap_allocate(heap, 64);
+  assert(small && (uintptr_t)small % HUGE_PAGE < 64);
+
+  heap_usage_t usage;
+  heap_get_usage(heap, &usage);
+  assert(usage.free_bytes + usage.used_bytes > HUGE_PAGE - 4096);
+
+  void* blocks[64];
+  for (int i = 0; i < 64; i++)
+    assert((blocks[i] = heap_allocate(heap, 100000)));
+  heap_validate(heap);
+  for (int i = 0; i < 64; i++)
+    heap_deallocate(heap, blocks[i]);
+
+  // big enough for huge pages of its own
+  uint8_t* large = heap_allocate(heap, 3 * HUGE_PAGE);
+  assert(large && (uintptr_t)large % HUGE_PAGE < 64);
+  large[3 * HUGE_PAGE - 1] = 1;
+  heap_deallocate(heap, large);
+
+  heap_deallocate(heap, small);
+  heap_validate(heap);
+  heap_destroy(heap);
+
+  // the memory we're given is advised as it is
+  printf("[*] Checking a heap in our own memory...\n");
+  size_t size = 3 * HUGE_PAGE;
+  void* memory = malloc(size);
+  heap = heap_create_with(memory, size, &options);
+  for (int i = 0; i < 64; i++)
+    assert((blocks[i] = heap_allocate(heap, 1000)));
+  heap_deallocate_batch(heap, blocks, 64);
+  heap_validate(heap);
+  heap_destroy(heap);
+  free(memory);
+
+  printf("[!] HUGE PAGES TESTS PASSED\n");
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+struct numa_thread_t
+{
+  heap_t* heap;
+  int     node;
+  void*   block;
+};
+
+static void* numa_thread(void* arg)
+{
+  struct numa_thread_t* t = arg;
+  set_thread_node(t->node);
+  t->block = heap_allocate(t->heap, 64);
+  return NULL;
+}
+
+// threads should allocate from the arenas on their own node
+static void test_numa()
+{
+  printf("NUMA TEST\n");
+
+  // two simulated nodes with an arena each, so each
+  // node has its own half of the memory
+  printf("[*] Checking threads use their node's arenas...\n");
+  heap_options_t options = { .algorithm = FIRSTFIT, .arenas = 2,
+    .arena_policy = ARENA_BY_NODE, .numa_nodes = 2 };
+  heap_t* heap = heap_create_with(arena_buffer, ARENA_MEMORY_SIZE, &options);
+
+  struct numa_thread_t threads[4];
+  pthread_t ids[4];
+  for (int i = 0; i < 4; i++)
+  {
+    threads[i] = (struct numa_thread_t){ heap, i % 2, NULL };
+    pthread_create(&ids[i], NULL, numa_thread, &threads[i]);
+    pthread_join(ids[i], NULL);
+    assert(threads[i].block);
+  }
+
+  uintptr_t half = (uintptr_t)arena_buffer + ARENA_MEMORY_SIZE / 2;
+  for (int i = 0; i < 4; i++)
+  {
+    assert(((uintptr_t)threads[i].block < half) == (threads[i].node == 0));
+    heap_deallocate(heap, threads[i].block);
+  }
+  heap_validate(heap);
+  heap_destroy(heap);
+
+  // more nodes than arenas asked for, and whatever the machine has
+  for (unsigned nodes = 0; nodes < 4; nodes += 3)
+  {
+    printf("[*] Running soak & merg tests on %d threads with %u nodes...\n",
+           THREAD_NUMBER, nodes);
+    heap_options_t node_options = { .algorithm = FIRSTFIT, .arenas = 2,
+      .arena_policy = ARENA_BY_NODE, .numa_nodes = nodes };
+    initialise_with(arena_buffer, ARENA_MEMORY_SIZE, &node_options);
+    start_test_threads();
+    validate();
+  }
+
+  printf("[!] NUMA TESTS PASSED\n");
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+#define REMOTE_BLOCKS 20
+#define REMOTE_ROUNDS 50
+
+static void* remote_producer(void* arg)
+{
+  struct numa_thread_t* t = arg;
+  void** blocks = t->block;
+  set_thread_node(t->node);
+
+  // too big for the thread cache, and more than fit in the
+  // arena at once if the frees never get back to it
+  for (int i = 0; i < REMOTE_BLOCKS; i++)
+  {
+    blocks[i] = heap_allocate(t->heap, 1000);
+    assert(blocks[i]);
+    assert((uintptr_t)blocks[i] < (uintptr_t)arena_buffer + ARENA_MEMORY_SIZE / 2);
+  }
+  return NULL;
+}
+
+static void* remote_consumer(void* arg)
+{
+  struct numa_thread_t* t = arg;
+  void** blocks = t->block;
+  set_thread_node(t->node);
+
+  for (int i = 0; i < REMOTE_BLOCKS; i++)
+    heap_deallocate(t->heap, blocks[i]);
+  return NULL;
+}
+
+// blocks freed by a thread using another arena should
+// make it back to the arena they came from
+static void test_remote_free()
+{
+  printf("REMOTE FREE TEST\n");
+  printf("[*] Freeing blocks on another node's thread...\n");
+
+  // a thread on each node, so each has an arena to itself
+  heap_options_t options = { .algorithm = FIRSTFIT, .arenas = 2,
+    .arena_policy = ARENA_BY_NODE, .numa_nodes = 2 };
+  heap_t* heap = heap_create_with(arena_buffer, ARENA_MEMORY_SIZE, &options);
+
+  void* blocks[REMOTE_BLOCKS];
+  struct numa_thread_t producer = { heap, 0, blocks };
+  struct numa_thread_t consumer = { heap, 1, blocks };
+
+  for (int round = 0; round < REMOTE_ROUNDS; round++)
+  {
+    pthread_t id;
+    pthread_create(&id, NULL, remote_producer, &producer);
+    pthread_join(id, NULL);
+    pthread_create(&id, NULL, remote_consumer, &consumer);
+    pthread_join(id, NULL);
+  }
+
+  // a block freed again while it waits on its arena's pending
+  // list should be caught rather than put on the list twice
+  printf("[*] Freeing blocks from another node twice...\n");
+  set_thread_node(0);
+  void* twice[3];
+  for (int i = 0; i < 3; i++)
+    twice[i] = heap_allocate(heap, 1000);
+  set_thread_node(1);
+
+  heap_deallocate(heap, twice[0]);
+  heap_deallocate(heap, twice[0]);
+  heap_deallocate(heap, twice[1]);
+  heap_deallocate_sized(heap, twice[1], 1000);
+  heap_deallocate(heap, twice[2]);
+  heap_deallocate_batch(heap, &twice[2], 1);
+  set_thread_node(-1);
+
+  // the last frees are only released when the arena is next locked
+  heap_usage_t usage;
+  heap_get_usage(heap, &usage);
+  assert(usage.used_bytes == 0 && usage.free_blocks == 2);
+  heap_validate(heap);
+  heap_destroy(heap);
+
+  printf("[!] REMOTE FREE TESTS PASSED\n");
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+// waits for the reclaimer to release everything in a heap
+static void wait_for_reclaimer(heap_t* heap, heap_usage_t* usage)
+{
+  struct timespec wait = { 0, 1000000 };
+  for (int n = 0; n < 1000; n++)
+  {
+    heap_get_usage(heap, usage);
+    if (usage->used_bytes == 0)
+      break;
+    nanosleep(&wait, NULL);
+  }
+}
+
+// frees should be queued and coalesced later, by the
+// reclaimer or by an allocation that needs the memory
+static void test_deferred_frees()
+{
+  printf("DEFERRED FREE TEST\n");
+  heap_options_t options = { .algorithm = FIRSTFIT, .deferred_frees = 1 };
+  heap_t* heap = heap_create_with(memory_buffer, MEMORY_SIZE, &options);
+
+  // too big for the thread cache, and nothing else fits
+  printf("[*] Allocating after deferred frees...\n");
+  void* blocks[7];
+  for (int n = 0; n < 7; n++)
+  {
+    blocks[n] = heap_allocate(heap, 1000);
+    assert(blocks[n]);
+  }
+  assert(heap_allocate(heap, 1000) == NULL);
+
+  // freed out of order, the allocation has to drain and
+  // coalesce them itself if the reclaimer hasn't yet
+  for (int n = 0; n < 7; n++)
+    heap_deallocate(heap, blocks[(n * 3) % 7]);
+  void* big = heap_allocate(heap, 6000);
+  assert(big == blocks[0]);
+  heap_validate(heap);
+
+  // the reclaimer should get to it soon enough
+  printf("[*] Waiting for the reclaimer...\n");
+  heap_deallocate(heap, big);
+
+  heap_usage_t usage;
+  wait_for_reclaimer(heap, &usage);
+  assert(usage.used_bytes == 0 && usage.free_blocks == 1);
+  heap_validate(heap);
+
+  // a batch is queued the same way rather than freed under the lock
+  printf("[*] Waiting for the reclaimer after a batch...\n");
+  assert(heap_allocate_batch(heap, 7, 1000, blocks) == 7);
+  heap_deallocate_batch(heap, blocks, 7);
+  wait_for_reclaimer(heap, &usage);
+  assert(usage.used_bytes == 0 && usage.free_blocks == 1);
+  heap_validate(heap);
+  heap_destroy(heap);
+
+  for (int i = 0; i < 2; i++)
+  {
+    printf("[*] Running soak & merg tests on %d threads with deferred frees...\n",THREAD_NUMBER);
+    heap_options_t soak_options = { .algorithm = i ? BESTFIT : FIRSTFIT, .arenas = 4,
+      .deferred_frees = 1 };
+    initialise_with(arena_buffer, ARENA_MEMORY_SIZE, &soak_options);
+    start_test_threads();
+    validate();
+  }
+
+  // stop the reclaimer before other tests use the memory
+  initialise(memory_buffer, MEMORY_SIZE, FIRSTFIT);
+
+  printf("[!] DEFERRED FREE TESTS PASSED\n");
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+// blocks should be carved off the end of the arena one after
+// another, until something doesn't fit
+static void test_wilderness()
+{
+  printf("WILDERNESS TEST\n");
+  heap_options_t options = { .algorithm = FIRSTFIT, .wilderness = 1 };
+  heap_t* heap = heap_create_with(memory_buffer, MEMORY_SIZE, &options);
+
+  // too big for the thread cache
+  printf("[*] Carving blocks...\n");
+  uint8_t* a = heap_allocate(heap, 1000);
+  uint8_t* b = heap_allocate(heap, 1000);
+  uint8_t* c = heap_allocate(heap, 1000);
+  assert(a && b - a == c - b && b - a > 1000);
+  heap_validate(heap);
+
+  // freed blocks are only used once the wilderness runs out
+  heap_deallocate(heap, b);
+  assert(heap_allocate(heap, 1000) == c + (c - b));
+  heap_validate(heap);
+
+  heap_usage_t usage;
+  heap_get_usage(heap, &usage);
+  assert(usage.free_blocks == 3);
+
+  // this doesn't fit in what's left, so the rest joins the arena
+  printf("[*] Using up the wilderness...\n");
+  size_t rest = usage.largest_free;
+  uint8_t* d = heap_allocate(heap, rest + 1);
+  assert(d == NULL);
+  d = heap_allocate(heap, rest);
+  assert(d);
+  heap_validate(heap);
+
+  // and the freed block is found by first fit
+  assert(heap_allocate(heap, 1000) == b);
+  heap_validate(heap);
+  heap_destroy(heap);
+
+  char* algorithms[] = { FIRSTFIT, NEXTFIT, BESTFIT, SEGREGATEDFIT };
+  for (int i = 0; i < 4; i++)
+  {
+    printf("[*] Running soak & merg tests on %d threads with a wilderness and %s...\n",
+           THREAD_NUMBER, algorithms[i]);
+    heap_options_t soak_options = { .algorithm = algorithms[i], .arenas = 4,
+      .wilderness = 1 };
+    initialise_with(arena_buffer, ARENA_MEMORY_SIZE, &soak_options);
+    start_test_threads();
+    validate();
+  }
+
+  printf("[!] WILDERNESS TESTS PASSED\n");
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+// every kind of arena lock should keep the arenas intact
+static void test_lock_policies()
+{
+  printf("LOCK POLICY TEST\n");
+  char* names[] = { "mutex", "adaptive", "ticket", "MCS" };
+  unsigned policies[] = { LOCK_MUTEX, LOCK_ADAPTIVE, LOCK_TICKET, LOCK_MCS };
+
+  for (int i = 0; i < 4; i++)
+  {
+    printf("[*] Running soak & merg tests on %d threads with %s locks...\n",
+           THREAD_NUMBER, names[i]);
+    heap_options_t options = { .algorithm = FIRSTFIT, .arenas = 2,
+      .lock_policy = policies[i] };
+    initialise_with(arena_buffer, ARENA_MEMORY_SIZE, &options);
+    start_test_threads();
+    validate();
+  }
+
+  printf("[!] LOCK POLICY TESTS PASSED\n");
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+// freeing with the size a block was allocated with should put
+// it back in the same place as an ordinary free
+static void test_sized_deallocate()
+{
+  printf("SIZED DEALLOCATE TEST\n");
+  char* algorithms[] = { FIRSTFIT, BUDDY };
+  size_t sizes[] = { 1, 24, 100, 500, 4000, 20000 };
+
+  for (int i = 0; i < 2; i++)
+  {
+    printf("[*] Freeing by size with %s...\n", algorithms[i]);
+    heap_options_t options = { .algorithm = algorithms[i], .mmap_threshold = 16384 };
+    heap_t* heap = heap_create_with(arena_buffer, ARENA_MEMORY_SIZE, &options);
+
+    void* blocks[6];
+    for (int j = 0; j < 6; j++)
+    {
+      blocks[j] = heap_allocate(heap, sizes[j]);
+      assert(blocks[j]);
+    }
+
+    heap_stats_t stats;
+    heap_get_stats(heap, &stats);
+    assert(stats.mapped_blocks == 1);
+
+    for (int j = 0; j < 6; j++)
+      heap_deallocate_sized(heap, blocks[j], sizes[j]);
+    heap_validate(heap);
+
+    heap_get_stats(heap, &stats);
+    assert(stats.mapped_blocks == 0);
+
+    // small blocks went to the thread cache and come straight back
+    assert(heap_allocate(heap, 100) == blocks[2]);
+    heap_deallocate_sized(heap, blocks[2], 100);
+
+    // aligned and reallocated blocks are freed by what they were given
+    void* aligned = heap_allocate_aligned(heap, 64, 200);
+    void* shrunk = heap_reallocate(heap, heap_allocate(heap, 3000), 1000);
+    assert(aligned && shrunk && (uintptr_t)aligned % 64 == 0);
+    heap_deallocate_sized(heap, aligned, 200);
+    heap_deallocate_sized(heap, shrunk, 1000);
+    heap_deallocate_sized(heap, NULL, 100);
+    heap_validate(heap);
+
+    // too big for the thread cache, so it is back in the arena
+    // and its header says so the second time
+    void* twice = heap_allocate(heap, 1000);
+    heap_deallocate_sized(heap, twice, 1000);
+    heap_deallocate_sized(heap, twice, 1000);
+    heap_validate(heap);
+    heap_destroy(heap);
+  }
+
+  printf("[!] SIZED DEALLOCATE TESTS PASSED\n");
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+#ifdef COMPACT_HEADERS
+
+static void test_compact_headers()
+{
+  printf("COMPACT HEADERS TEST\n");
+  heap_options_t options = { .algorithm = FIRSTFIT, .arenas = 1 };
+  heap_t* heap = heap_create_with(arena_buffer, ARENA_MEMORY_SIZE, &options);
+
+  // too big for the thread cache, so they come straight from the arena
+  printf("[*] Checking header size...\n");
+  uint8_t* a = heap_allocate(heap, 1000);
+  uint8_t* b = heap_allocate(heap, 1000);
+  uint8_t* c = heap_allocate(heap, 1000);
+  assert(b - a == 1000 + sizeof(size_t));
+  assert(c - b == 1000 + sizeof(size_t));
+  assert((uintptr_t)a % 16 == 0 && (uintptr_t)b % 16 == 0);
+
+  // b finds a through its boundary tag, and c through its size
+  printf("[*] Checking coalescing...\n");
+  heap_deallocate(heap, a);
+  heap_deallocate(heap, c);
+  heap_validate(heap);
+  heap_deallocate(heap, b);
+  heap_validate(heap);
+
+  heap_usage_t usage;
+  heap_get_usage(heap, &usage);
+  assert(usage.free_blocks == 1);
+  assert(usage.used_bytes == 0);
+
+  // and the memory can be used again as one block
+  assert(heap_allocate(heap, 3000) == a);
+
+  heap_destroy(heap);
+  printf("[!] COMPACT HEADERS TESTS PASSED\n");
+  printf("========================\n");
+}
+
+#endif
+
+
+/*------------------------------------------------------*/
+
+
+#ifdef MM_INSTRUMENT
+
+// counts everything in a histogram
+static unsigned long long histogram_total(const unsigned long long* histogram)
+{
+  unsigned long long total = 0;
+  for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+    total += histogram[b];
+  return total;
+}
+
+
+/*------------------------------------------------------*/
+
+
+static void test_instrument()
+{
+  printf("INSTRUMENT TEST\n");
+  initialise(memory_buffer, MEMORY_SIZE, FIRSTFIT);
+
+  instrument_report_t before, after;
+  get_instrument_report(&before);
+
+  // too big for the thread cache, so every one searches the list
+  printf("[*] Running instrumented allocations...\n");
+  void* blocks[10];
+  for (int n = 0; n < 10; n++)
+    blocks[n] = allocate(600 + n);
+  for (int n = 0; n < 10; n++)
+    deallocate(blocks[n]);
+
+  get_instrument_report(&after);
+
+  // 600 to 609 bytes all go in the [512, 1023] bucket
+  assert(after.request_sizes[10] - before.request_sizes[10] == 10);
+  assert(histogram_total(after.request_sizes) - histogram_total(before.request_sizes) == 10);
+
+  // every search visits at least one node, and every lock
+  // that was waited for was also held
+  assert(histogram_total(after.nodes_visited) - histogram_total(before.nodes_visited) == 10);
+  assert(after.nodes_visited[0] == before.nodes_visited[0]);
+  assert(histogram_total(after.lock_wait_ns) == histogram_total(after.lock_hold_ns));
+
+  print_instrument_report();
+  validate();
+  printf("[!] INSTRUMENT TESTS PASSED\n");
+  printf("========================\n");
+}
+
+#endif
+
+
+/*------------------------------------------------------*/
+
+
+#ifdef MM_TRACE
+
+#define TRACE_FILE "memory_manager_test.trace"
+#define TRACE_BLOCKS 1000
+
+// allocates and frees blocks while being traced
+static void* trace_test(void* arg)
+{
+  (void)arg;
+  void* blocks[16];
+
+  for (int i = 0; i < TRACE_BLOCKS / 16; i++)
+  {
+    for (int n = 0; n < 16; n++)
+      blocks[n] = allocate_uninitialised(16 + n * 8);
+
+    for (int n = 0; n < 16; n++)
+      deallocate(blocks[n]);
+  }
+  return NULL;
+}
+
+
+/*------------------------------------------------------*/
+
+
+static void test_trace()
+{
+  printf("TRACE TEST\n");
+  initialise(arena_buffer, ARENA_MEMORY_SIZE, FIRSTFIT);
+  assert(trace_start(TRACE_FILE) == 0);
+
+  printf("[*] Tracing %d threads...\n", HEAP_NUMBER);
+  pthread_t tid[HEAP_NUMBER];
+  for (int i = 0; i < HEAP_NUMBER; i++)
+    pthread_create(&tid[i], NULL, &trace_test, NULL);
+
+  for (int i = 0; i < HEAP_NUMBER; i++)
+    pthread_join(tid[i], NULL);
+
+  trace_stop();
+
+  // every allocation and free should be there, and
+  // nothing can be freed before it was allocated
+  FILE* file = fopen(TRACE_FILE, "rb");
+  assert(file);
+
+  char magic[sizeof(TRACE_MAGIC)] = { 0 };
+  assert(fread(magic, 1, strlen(TRACE_MAGIC), file) == strlen(TRACE_MAGIC));
+  assert(strcmp(magic, TRACE_MAGIC) == 0);
+
+  trace_record_t r;
+  size_t allocations = 0;
+  size_t deallocations = 0;
+  while (fread(&r, sizeof(r), 1, file) == 1)
+  {
+    assert(r.thread >= 1);
+    assert(r.block != 0);
+    if (r.op == TRACE_ALLOCATE_UNINITIALISED)
+      allocations++;
+    else
+    {
+      assert(r.op == TRACE_DEALLOCATE);
+      deallocations++;
+    }
+    assert(deallocations <= allocations);
+  }
+
+  fclose(file);
+  remove(TRACE_FILE);
+
+  size_t expected = (size_t)HEAP_NUMBER * (TRACE_BLOCKS / 16) * 16;
+  assert(allocations == expected);
+  assert(deallocations == expected);
+
+  validate();
+  printf("[!] TRACE TESTS PASSED\n");
+  printf("========================\n");
+}
+
+#endif
+
+
+/*------------------------------------------------------*/
+
+
 void main()
 {
   test_first_fit();
   test_next_fit();
   test_best_fit();
   test_worst_fit();
+  test_segregated_fit();
+  test_buddy();
+  test_thread_cache();
+  test_heaps();
+  test_arenas();
+  test_pool();
+  test_reallocate();
+  test_aligned();
+  test_batches();
+  test_stats();
+  test_mapped();
+  test_large_blocks();
+  test_huge_pages();
+  test_numa();
+  test_remote_free();
+  test_deferred_frees();
+  test_wilderness();
+  test_lock_policies();
+  test_sized_deallocate();
+#ifdef COMPACT_HEADERS
+  test_compact_headers();
+#endif
+#ifdef MM_INSTRUMENT
+  test_instrument();
+#endif
+#ifdef MM_TRACE
+  test_trace();
+#endif
 }
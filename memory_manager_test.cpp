@@ -0,0 +1,194 @@
+/*
+*----------------------------------------------------------------------------*
+*  memory_manager_test.cpp                                                   *
+*                                                                            *
+*  Description: Tests the C++17 adapters in memory_manager.hpp, built        *
+*               against the C memory manager with                            *
+*                                                                            *
+*                 gcc -c -pthread memory_manager.c memory_pool.c             *
+*                 g++ -std=c++17 -pthread memory_manager_test.cpp            *
+*                     memory_manager.o memory_pool.o                         *
+*                                                                            *
+*               Standard containers are filled through each allocator and    *
+*               the heaps are validated once the containers are gone.        *
+*----------------------------------------------------------------------------*
+*/
+
+
+
+#include <cstdint>
+#include <cstdio>
+#include <cassert>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <memory_resource>
+
+#include "memory_manager.hpp"
+
+using namespace memory_manager;
+
+
+#define ARENA_MEMORY_SIZE (1 << 22)
+#define DEFAULT_MEMORY_SIZE (1 << 20)
+#define NUMBER_OF_ITEMS 10000
+
+static unsigned char arena_buffer[ARENA_MEMORY_SIZE];
+static unsigned char default_buffer[DEFAULT_MEMORY_SIZE];
+
+// bigger than anything the heap aligns to on its own
+struct alignas(64) over_aligned_t
+{
+  char bytes[64];
+};
+
+
+/*------------------------------------------------------*/
+
+
+static void test_heap_resource()
+{
+  printf("HEAP RESOURCE TEST\n");
+
+  heap_options_t options = {};
+  options.algorithm = (char*)FIRSTFIT;
+  options.arenas = 2;
+
+  // nothing gets a mapping of its own, so a big enough request fails
+  options.mmap_threshold = SIZE_MAX;
+  heap_t* heap = heap_create_with(arena_buffer, ARENA_MEMORY_SIZE, &options);
+  assert(heap);
+
+  heap_resource resource(heap);
+
+  printf("[*] Filling pmr containers...\n");
+  {
+    std::pmr::vector<int> numbers(&resource);
+    for (int i = 0; i < NUMBER_OF_ITEMS; i++)
+      numbers.push_back(i);
+
+    std::pmr::unordered_map<int, std::pmr::string> strings(&resource);
+    for (int i = 0; i < NUMBER_OF_ITEMS / 2; i++)
+      strings[i] = std::pmr::string(40, 'x');
+
+    std::pmr::vector<over_aligned_t> wide(&resource);
+    wide.resize(100);
+    assert((uintptr_t)wide.data() % alignof(over_aligned_t) == 0);
+
+    for (int i = 0; i < NUMBER_OF_ITEMS; i++)
+      assert(numbers[i] == i);
+  }
+  heap_validate(heap);
+
+  // resources are equal when they share a heap
+  printf("[*] Comparing resources...\n");
+  heap_resource same(heap), other(nullptr);
+  assert(resource == same);
+  assert(!(resource == other));
+
+  printf("[*] Allocating more than the heap holds...\n");
+  int thrown = 0;
+  try
+  {
+    (void)resource.allocate(ARENA_MEMORY_SIZE * 2);
+  }
+  catch (const std::bad_alloc&)
+  {
+    thrown = 1;
+  }
+  assert(thrown);
+
+  heap_destroy(heap);
+  printf("[!] HEAP RESOURCE TESTS PASSED\n");
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+static void test_heap_allocator()
+{
+  printf("HEAP ALLOCATOR TEST\n");
+
+  heap_options_t options = {};
+  options.algorithm = (char*)BESTFIT;
+  heap_t* heap = heap_create_with(arena_buffer, ARENA_MEMORY_SIZE, &options);
+  assert(heap);
+
+  printf("[*] Filling containers...\n");
+  {
+    heap_allocator<int> allocator(heap);
+    std::vector<int, heap_allocator<int>> numbers(allocator);
+    for (int i = 0; i < NUMBER_OF_ITEMS; i++)
+      numbers.push_back(i);
+
+    typedef heap_allocator<std::pair<const int, int>> pair_allocator;
+    std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, pair_allocator>
+      squares(16, std::hash<int>(), std::equal_to<int>(), pair_allocator(heap));
+    for (int i = 0; i < NUMBER_OF_ITEMS; i++)
+      squares[i] = i * i;
+
+    // copies keep the heap and can swap memory with the original
+    std::vector<int, heap_allocator<int>> copy = numbers;
+    assert(copy.get_allocator() == numbers.get_allocator());
+    copy.swap(numbers);
+    assert(numbers.size() == NUMBER_OF_ITEMS && squares[100] == 10000);
+  }
+
+  printf("[*] Allocating an over-aligned type...\n");
+  {
+    std::vector<over_aligned_t, heap_allocator<over_aligned_t>> wide{heap_allocator<over_aligned_t>(heap)};
+    for (int i = 0; i < 100; i++)
+    {
+      wide.emplace_back();
+      assert((uintptr_t)wide.data() % alignof(over_aligned_t) == 0);
+    }
+  }
+  heap_validate(heap);
+
+  heap_destroy(heap);
+  printf("[!] HEAP ALLOCATOR TESTS PASSED\n");
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+static void test_default_heap_allocator()
+{
+  printf("DEFAULT HEAP ALLOCATOR TEST\n");
+
+  heap_options_t options = {};
+  options.algorithm = (char*)SEGREGATEDFIT;
+  initialise_with(default_buffer, DEFAULT_MEMORY_SIZE, &options);
+
+  printf("[*] Filling containers from the default heap...\n");
+  {
+    std::vector<double, default_heap_allocator<double>> numbers(1000, 1.0);
+
+    // the allocator takes no room in the container
+    static_assert(sizeof(numbers) == sizeof(std::vector<double>));
+
+    std::vector<over_aligned_t, default_heap_allocator<over_aligned_t>> wide(10);
+    assert((uintptr_t)wide.data() % alignof(over_aligned_t) == 0);
+    assert(numbers.get_allocator() == default_heap_allocator<int>());
+  }
+
+  validate();
+  printf("[!] DEFAULT HEAP ALLOCATOR TESTS PASSED\n");
+  printf("========================\n");
+}
+
+
+/*------------------------------------------------------*/
+
+
+int main()
+{
+  test_heap_resource();
+  test_heap_allocator();
+  test_default_heap_allocator();
+  return 0;
+}
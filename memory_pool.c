@@ -0,0 +1,303 @@
+/*
+*----------------------------------------------------------------------------*
+*  memory_pool.c                                                             *
+*                                                                            *
+*  Description: Fixed-size object pools built on top of the thread-safe      *
+*               memory manager.                                              *
+*                                                                            *
+*               Free objects are kept on a Treiber stack. Objects are        *
+*               numbered, and the top of the stack is a 64 bit word holding  *
+*               the top object's number and a tag that changes on every      *
+*               push and pop, so a stale compare-and-swap always fails.      *
+*----------------------------------------------------------------------------*
+*/
+
+
+#include "memory_pool.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+
+// a pool can grow this many times, each slab is twice the size
+// of the one before so this is plenty
+#define POOL_MAX_SLABS 32
+
+// objects are rounded up to this
+#define POOL_ALIGNMENT (2 * sizeof(void*))
+
+struct pool_t
+{
+  // where slabs come from, NULL for the default heap
+  heap_t*            heap;
+
+  size_t             object_size;
+  size_t             slab_objects;
+
+  // low 32 bits are the top object's number plus one (zero when
+  // the stack is empty), high 32 bits are the tag
+  _Atomic uint64_t   head;
+
+  // slabs are only ever added, under the lock
+  pthread_mutex_t    grow_lock;
+  atomic_uint        slab_count;
+  uint8_t*           slabs[POOL_MAX_SLABS];
+};
+
+
+/*...........................................................................*/
+/*..                          COMMON FUNCTIONS                             ..*/
+/*...........................................................................*/
+
+
+// slabs don't need zeroing, we write the links anyway
+static void* pool_heap_allocate(heap_t* heap, size_t bytes)
+{
+  return heap ? heap_allocate_uninitialised(heap, bytes) : allocate_uninitialised(bytes);
+}
+
+
+static void pool_heap_deallocate(heap_t* heap, void* memory)
+{
+  if (heap)
+    heap_deallocate(heap, memory);
+  else
+    deallocate(memory);
+}
+
+
+/**
+*
+* Finds the object with a given number. Slab k holds slab_objects << k
+* objects, so the first object in slab k is slab_objects * (2^k - 1)
+* and the slab is the highest bit of id / slab_objects + 1.
+*
+* @param pool : The pool
+* @param id : Number of the object
+*
+* @return Pointer to the object.
+*
+*/
+static uint8_t* object_at(pool_t* pool, uint32_t id)
+{
+  size_t   q = id / pool->slab_objects + 1;
+  unsigned k = 63 - __builtin_clzll((unsigned long long)q);
+  size_t   first = pool->slab_objects * (((size_t)1 << k) - 1);
+
+  return pool->slabs[k] + (id - first) * pool->object_size;
+}
+
+
+/**
+*
+* Finds the number of an object from its address
+*
+* @param pool : The pool
+* @param memory : Pointer to the object
+*
+* @return Number of the object.
+*
+*/
+static uint32_t object_id(pool_t* pool, void* memory)
+{
+  unsigned count = atomic_load_explicit(&pool->slab_count, memory_order_acquire);
+  size_t   first = 0;
+
+  for (unsigned k = 0; k < count; k++)
+  {
+    size_t objects = pool->slab_objects << k;
+    uint8_t* slab = pool->slabs[k];
+
+    if ((uint8_t*)memory >= slab && (uint8_t*)memory < slab + objects * pool->object_size)
+    {
+      size_t offset = (uint8_t*)memory - slab;
+
+      // must point at the start of an object
+      assert(offset % pool->object_size == 0);
+      return (uint32_t)(first + offset / pool->object_size);
+    }
+
+    first += objects;
+  }
+
+  // memory didn't come from this pool
+  assert(0);
+  return 0;
+}
+
+
+// the link to the next free object is kept in the object itself.
+// Another thread may pop the object while we read it, the tag makes
+// sure we then throw away what we read, so the read has to be atomic
+static uint32_t object_next(uint8_t* object)
+{
+  return atomic_load_explicit((_Atomic uint32_t*)object, memory_order_relaxed);
+}
+
+
+static void object_set_next(uint8_t* object, uint32_t next)
+{
+  atomic_store_explicit((_Atomic uint32_t*)object, next, memory_order_relaxed);
+}
+
+
+/**
+*
+* Pushes a chain of linked objects onto the free stack
+*
+* @param pool : The pool
+* @param first : Number of the first object in the chain
+* @param last : Pointer to the last object in the chain
+*
+*/
+static void push_chain(pool_t* pool, uint32_t first, uint8_t* last)
+{
+  uint64_t head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+  uint64_t next;
+
+  do
+  {
+    object_set_next(last, (uint32_t)head);
+    next = ((head >> 32) + 1) << 32 | (first + 1);
+  } while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, next,
+             memory_order_release, memory_order_relaxed));
+}
+
+
+/**
+*
+* Adds a new slab to the pool and pushes its objects onto the stack
+*
+* @param pool : The pool
+*
+* @return Whether the pool has free objects.
+*
+*/
+static int pool_grow(pool_t* pool)
+{
+  int grown = 0;
+
+  pthread_mutex_lock(&pool->grow_lock);
+
+  // someone else may have grown it while we waited
+  if ((uint32_t)atomic_load(&pool->head))
+  {
+    pthread_mutex_unlock(&pool->grow_lock);
+    return 1;
+  }
+
+  unsigned k = atomic_load_explicit(&pool->slab_count, memory_order_relaxed);
+  size_t objects = pool->slab_objects << k;
+  size_t first = pool->slab_objects * (((size_t)1 << k) - 1);
+
+  // object numbers have to fit in 32 bits
+  if (k < POOL_MAX_SLABS && first + objects < UINT32_MAX)
+  {
+    uint8_t* slab = pool_heap_allocate(pool->heap, objects * pool->object_size);
+
+    if (slab)
+    {
+      // link the objects in order
+      for (size_t i = 0; i + 1 < objects; i++)
+        object_set_next(slab + i * pool->object_size, (uint32_t)(first + i + 2));
+
+      pool->slabs[k] = slab;
+      atomic_store_explicit(&pool->slab_count, k + 1, memory_order_release);
+
+      push_chain(pool, (uint32_t)first, slab + (objects - 1) * pool->object_size);
+      grown = 1;
+    }
+  }
+
+  pthread_mutex_unlock(&pool->grow_lock);
+  return grown;
+}
+
+
+/*...........................................................................*/
+/*..                          PUBLIC FUNCTIONS                             ..*/
+/*...........................................................................*/
+
+
+// full description in header file
+pool_t* pool_create(heap_t* heap, size_t object_size, size_t slab_objects)
+{
+  assert(object_size > 0);
+  assert(slab_objects > 0);
+
+  pool_t* pool = pool_heap_allocate(heap, sizeof(pool_t));
+  if (pool == NULL)
+    return NULL;
+
+  // objects have to hold the link to the next one
+  if (object_size < sizeof(uint32_t))
+    object_size = sizeof(uint32_t);
+
+  pool->heap = heap;
+  pool->object_size = (object_size + POOL_ALIGNMENT - 1) & ~(POOL_ALIGNMENT - 1);
+  pool->slab_objects = slab_objects;
+  atomic_init(&pool->head, 0);
+  atomic_init(&pool->slab_count, 0);
+  pthread_mutex_init(&pool->grow_lock, NULL);
+
+  return pool;
+}
+
+
+// full description in header file
+void pool_destroy(pool_t* pool)
+{
+  if (pool == NULL)
+    return;
+
+  unsigned count = atomic_load(&pool->slab_count);
+  for (unsigned k = 0; k < count; k++)
+    pool_heap_deallocate(pool->heap, pool->slabs[k]);
+
+  pthread_mutex_destroy(&pool->grow_lock);
+  pool_heap_deallocate(pool->heap, pool);
+}
+
+
+// full description in header file
+void* pool_allocate(pool_t* pool)
+{
+  assert(pool);
+
+  uint64_t head = atomic_load_explicit(&pool->head, memory_order_acquire);
+  uint64_t next;
+  uint8_t* object;
+
+  do
+  {
+    // empty, so get another slab
+    while ((uint32_t)head == 0)
+    {
+      if (!pool_grow(pool))
+        return NULL;
+      head = atomic_load_explicit(&pool->head, memory_order_acquire);
+    }
+
+    object = object_at(pool, (uint32_t)head - 1);
+    next = ((head >> 32) + 1) << 32 | object_next(object);
+  } while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, next,
+             memory_order_acquire, memory_order_acquire));
+
+  return object;
+}
+
+
+// full description in header file
+void pool_deallocate(pool_t* pool, void* memory)
+{
+  assert(pool);
+
+  // should be ok to pass in NULL
+  if (memory == NULL)
+    return;
+
+  push_chain(pool, object_id(pool, memory), memory);
+}
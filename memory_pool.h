@@ -0,0 +1,85 @@
+/*
+*----------------------------------------------------------------------------*
+*  memory_pool.h                                                             *
+*                                                                            *
+*  Description: Header file for fixed-size object pools built on top of the  *
+*               thread-safe memory manager.                                  *
+*                                                                            *
+*               A pool carves slabs out of a heap for objects of one size    *
+*               and hands them out from a lock-free stack, so allocating     *
+*               and freeing an object never takes a lock or walks the heap.  *
+*----------------------------------------------------------------------------*
+*/
+
+#ifndef MEMORY_POOL_H__
+#define MEMORY_POOL_H__
+
+#include <stddef.h>
+
+#include "memory_manager.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /**
+   * Handle to a pool created with pool_create()
+  */
+  typedef struct pool_t pool_t;
+
+
+  /**
+  *
+  * Creates a pool of fixed-size objects. Slabs of objects are taken
+  * from the heap when the pool runs out, each one twice as big as
+  * the last.
+  *
+  * @param heap : The heap to take slabs from, NULL for the default heap.
+  * @param object_size : The size of each object in bytes.
+  * @param slab_objects : How many objects go in the first slab.
+  *
+  * @return Handle to the new pool, or NULL if the heap is full.
+  *
+  */
+  pool_t* pool_create(heap_t* heap, size_t object_size, size_t slab_objects);
+
+
+  /**
+  *
+  * Destroys a pool and gives its slabs back to the heap. Nothing
+  * allocated from the pool may be used afterwards.
+  *
+  * @param pool : The pool to destroy.
+  *
+  */
+  void pool_destroy(pool_t* pool);
+
+
+  /**
+   *
+   * Returns an object from a pool. Unlike allocate() the memory
+   * is not zeroed.
+   *
+   * @param pool : The pool to allocate from
+   *
+   * @return Pointer to the object, or NULL if the heap is full.
+   *
+  */
+  void* pool_allocate(pool_t* pool);
+
+
+  /**
+   *
+   * Gives an object back to the pool it came from.
+   *
+   * @param pool : The pool the object was allocated from
+   * @param memory : Pointer to the object, may be NULL.
+   *
+  */
+  void pool_deallocate(pool_t* pool, void* memory);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
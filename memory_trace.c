@@ -0,0 +1,244 @@
+/*
+*----------------------------------------------------------------------------*
+*  memory_trace.c                                                            *
+*                                                                            *
+*  Description: Records a trace of allocations and deallocations.            *
+*                                                                            *
+*               Threads claim a slot in the ring buffer with a single        *
+*               atomic add and fill it in. Every slot has a sequence         *
+*               number saying whether it is waiting to be filled in or       *
+*               waiting to be written, and a flusher thread writes filled    *
+*               slots to the file in order. A thread only waits if the       *
+*               ring is full.                                                *
+*----------------------------------------------------------------------------*
+*/
+
+
+#include "memory_trace.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+
+// records held in memory, must be a power of two
+#define TRACE_RING_SIZE 65536
+
+// records written to the file at once
+#define TRACE_WRITE_BATCH 1024
+
+// how long the flusher sleeps when there's nothing to write
+#define TRACE_IDLE_NS 1000000
+
+
+struct trace_slot_t
+{
+  // equal to the slot's position when it can be filled in,
+  // and one more than that once it has been
+  _Atomic uint64_t sequence;
+  trace_record_t   record;
+};
+
+static struct trace_slot_t ring[TRACE_RING_SIZE];
+
+// next position to fill in, and the next to write
+static _Atomic uint64_t ring_tail;
+static uint64_t ring_head;
+
+// set while tracing, threads in trace_record are
+// counted so trace_stop can wait for them
+static atomic_int tracing;
+static atomic_int writers;
+
+static FILE* trace_file;
+static pthread_t flusher;
+static atomic_int flusher_running;
+static uint64_t start_time;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_uint thread_count;
+static __thread uint32_t thread_number;
+
+
+static uint64_t now_ns()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+
+/**
+*
+* Writes out every record that has been filled in
+*
+* @param batch : Somewhere to collect the records
+*
+* @return How many records were written.
+*
+*/
+static size_t trace_flush(trace_record_t* batch)
+{
+  size_t count = 0;
+  size_t total = 0;
+
+  for (;;)
+  {
+    struct trace_slot_t* slot = &ring[ring_head & (TRACE_RING_SIZE - 1)];
+
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != ring_head + 1)
+      break;
+
+    batch[count++] = slot->record;
+
+    // the slot can be used again next time round the ring
+    atomic_store_explicit(&slot->sequence, ring_head + TRACE_RING_SIZE, memory_order_release);
+    ring_head++;
+
+    if (count == TRACE_WRITE_BATCH)
+    {
+      fwrite(batch, sizeof(trace_record_t), count, trace_file);
+      total += count;
+      count = 0;
+    }
+  }
+
+  fwrite(batch, sizeof(trace_record_t), count, trace_file);
+  return total + count;
+}
+
+
+// writes records until told to stop
+static void* trace_flusher(void* arg)
+{
+  (void)arg;
+  static trace_record_t batch[TRACE_WRITE_BATCH];
+  struct timespec idle = { 0, TRACE_IDLE_NS };
+
+  while (atomic_load(&flusher_running))
+  {
+    if (trace_flush(batch) == 0)
+      nanosleep(&idle, NULL);
+  }
+
+  // everything has been claimed by now, so wait for the last
+  // records to be filled in
+  while (ring_head != atomic_load(&ring_tail))
+  {
+    if (trace_flush(batch) == 0)
+      sched_yield();
+  }
+
+  return NULL;
+}
+
+
+// full description in header file
+int trace_start(const char* path)
+{
+  assert(path);
+  pthread_mutex_lock(&trace_lock);
+
+  if (trace_file)
+  {
+    pthread_mutex_unlock(&trace_lock);
+    fprintf(stderr, "Error : already tracing\n");
+    return -1;
+  }
+
+  trace_file = fopen(path, "wb");
+  if (trace_file == NULL)
+  {
+    pthread_mutex_unlock(&trace_lock);
+    fprintf(stderr, "Error : cannot open trace file %s\n", path);
+    return -1;
+  }
+
+  fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), trace_file);
+
+  // every slot is free, starting from the beginning
+  for (uint64_t i = 0; i < TRACE_RING_SIZE; i++)
+    atomic_store_explicit(&ring[i].sequence, i, memory_order_relaxed);
+  ring_head = 0;
+  atomic_store(&ring_tail, 0);
+
+  start_time = now_ns();
+  atomic_store(&flusher_running, 1);
+  pthread_create(&flusher, NULL, trace_flusher, NULL);
+  atomic_store(&tracing, 1);
+
+  pthread_mutex_unlock(&trace_lock);
+  return 0;
+}
+
+
+// full description in header file
+void trace_stop()
+{
+  pthread_mutex_lock(&trace_lock);
+
+  if (trace_file)
+  {
+    // no new records, and wait for anyone part way through one
+    atomic_store(&tracing, 0);
+    while (atomic_load(&writers))
+      sched_yield();
+
+    atomic_store(&flusher_running, 0);
+    pthread_join(flusher, NULL);
+
+    fclose(trace_file);
+    trace_file = NULL;
+  }
+
+  pthread_mutex_unlock(&trace_lock);
+}
+
+
+// full description in header file
+void trace_record(trace_op_t op, size_t size, size_t alignment,
+                  const void* old_block, const void* block)
+{
+  atomic_fetch_add(&writers, 1);
+
+  if (!atomic_load(&tracing))
+  {
+    atomic_fetch_sub(&writers, 1);
+    return;
+  }
+
+  if (thread_number == 0)
+    thread_number = atomic_fetch_add(&thread_count, 1) + 1;
+
+  uint64_t position = atomic_fetch_add_explicit(&ring_tail, 1, memory_order_relaxed);
+  struct trace_slot_t* slot = &ring[position & (TRACE_RING_SIZE - 1)];
+
+  // the ring is full, wait for the flusher to catch up
+  while (atomic_load_explicit(&slot->sequence, memory_order_acquire) != position)
+    sched_yield();
+
+  trace_record_t* r = &slot->record;
+  r->time      = now_ns() - start_time;
+  r->size      = size;
+  r->block     = (uintptr_t)block;
+  r->old_block = (uintptr_t)old_block;
+  r->thread    = thread_number;
+  r->op        = (uint8_t)op;
+  r->reserved  = 0;
+  r->alignment_log2 = 0;
+
+  while (alignment > 1)
+  {
+    r->alignment_log2++;
+    alignment >>= 1;
+  }
+
+  atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+  atomic_fetch_sub(&writers, 1);
+}
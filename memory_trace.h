@@ -0,0 +1,119 @@
+/*
+*----------------------------------------------------------------------------*
+*  memory_trace.h                                                            *
+*                                                                            *
+*  Description: Header file for recording a trace of every allocation and    *
+*               deallocation made through the memory manager, so it can be   *
+*               replayed later with memory_manager_replay.                   *
+*                                                                            *
+*               Tracing is only compiled in when MM_TRACE is defined, e.g.   *
+*               gcc -DMM_TRACE ... memory_manager.c memory_trace.c           *
+*                                                                            *
+*               Records go into a ring buffer and a background thread        *
+*               writes them out, so callers never wait on the file.          *
+*----------------------------------------------------------------------------*
+*/
+
+#ifndef MEMORY_TRACE_H__
+#define MEMORY_TRACE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /**
+   * A trace file starts with this, then a list of trace_record_t
+  */
+  #define TRACE_MAGIC "MMTRACE1"
+
+  /**
+   * What a trace record is for
+  */
+  typedef enum trace_op_t
+  {
+    TRACE_ALLOCATE = 1,
+    TRACE_ALLOCATE_UNINITIALISED,
+    TRACE_ALLOCATE_ALIGNED,
+    TRACE_DEALLOCATE,
+    TRACE_REALLOCATE
+  } trace_op_t;
+
+  /**
+   * One allocation or deallocation. Blocks are identified by their
+   * address, which is only used to match allocations with frees.
+  */
+  typedef struct trace_record_t
+  {
+    // nanoseconds since tracing started
+    uint64_t time;
+
+    // bytes asked for, 0 for a deallocate
+    uint64_t size;
+
+    // the block returned, or freed for a deallocate, 0 if
+    // the allocation failed
+    uint64_t block;
+
+    // the block passed to reallocate
+    uint64_t old_block;
+
+    // which thread did it, numbered from 1 in the order
+    // threads were first traced
+    uint32_t thread;
+
+    // one of trace_op_t
+    uint8_t  op;
+
+    // log2 of the alignment for TRACE_ALLOCATE_ALIGNED
+    uint8_t  alignment_log2;
+
+    uint16_t reserved;
+  } trace_record_t;
+
+
+  /**
+  *
+  * Starts writing a trace of every allocation and deallocation, on
+  * any heap, to a file. Anything already in the file is replaced.
+  *
+  * @param path : The file to write to.
+  *
+  * @return 0 if tracing started, -1 if the file couldn't be opened
+  *         or a trace is already being written.
+  *
+  */
+  int trace_start(const char* path);
+
+
+  /**
+  *
+  * Stops tracing, waits for every record to be written
+  * and closes the file.
+  *
+  */
+  void trace_stop();
+
+
+  /**
+  *
+  * Adds a record to the trace, called by the memory manager.
+  * Does nothing if tracing hasn't been started.
+  *
+  * @param op : What was done
+  * @param size : Bytes asked for
+  * @param alignment : Alignment asked for, or 0
+  * @param old_block : Block passed to reallocate, or NULL
+  * @param block : Block returned or freed
+  *
+  */
+  void trace_record(trace_op_t op, size_t size, size_t alignment,
+                    const void* old_block, const void* block);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif